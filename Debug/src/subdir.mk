@@ -5,27 +5,51 @@
 # Add inputs and outputs from these tool invocations to the build variables 
 CPP_SRCS += \
 ../src/AllKorrect.cpp \
+../src/BlobIndex.cpp \
+../src/Cgroup.cpp \
+../src/Compare.cpp \
+../src/Compile.cpp \
+../src/Compress.cpp \
 ../src/Daemon.cpp \
 ../src/Execute.cpp \
 ../src/FileSystem.cpp \
+../src/Hash.cpp \
 ../src/Log.cpp \
-../src/Message.cpp 
+../src/Message.cpp \
+../src/Pch.cpp \
+../src/Watchdog.cpp 
 
 OBJS += \
 ./src/AllKorrect.o \
+./src/BlobIndex.o \
+./src/Cgroup.o \
+./src/Compare.o \
+./src/Compile.o \
+./src/Compress.o \
 ./src/Daemon.o \
 ./src/Execute.o \
 ./src/FileSystem.o \
+./src/Hash.o \
 ./src/Log.o \
-./src/Message.o 
+./src/Message.o \
+./src/Pch.o \
+./src/Watchdog.o 
 
 CPP_DEPS += \
 ./src/AllKorrect.d \
+./src/BlobIndex.d \
+./src/Cgroup.d \
+./src/Compare.d \
+./src/Compile.d \
+./src/Compress.d \
 ./src/Daemon.d \
 ./src/Execute.d \
 ./src/FileSystem.d \
+./src/Hash.d \
 ./src/Log.d \
-./src/Message.d 
+./src/Message.d \
+./src/Pch.d \
+./src/Watchdog.d 
 
 
 # Each subdirectory must supply rules for building sources it contributes
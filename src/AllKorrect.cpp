@@ -1,4 +1,5 @@
 #include <unistd.h>
+#include <getopt.h>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -7,12 +8,57 @@
 #include "Log.h"
 #include "Daemon.h"
 #include "FileSystem.h"
+#include "Compress.h"
+#include "Pch.h"
 
 #ifndef __x86_64__
 #error "AllKorrect is designed for x64 only"
 #endif
 
-void Main() {
+static void parseOptions(int argc, char* argv[]) {
+	int opt;
+	while ((opt = getopt(argc, argv, "w:b:z:ct:p:l:u:H:")) != -1) {
+		switch (opt) {
+		case 'w':
+			Daemon::Workers = atoi(optarg);
+			break;
+		case 'b':
+			Daemon::Backlog = atoi(optarg);
+			break;
+		case 'z':
+			Execute::PoolSize = atoi(optarg);
+			break;
+		case 'c':
+			FileSystem::ContentAddressed = true;
+			break;
+		case 't':
+			FileSystem::WorkspaceSize = atoll(optarg) * 1024 * 1024;
+			break;
+		case 'p':
+			Daemon::SessionThreads = atoi(optarg);
+			break;
+		case 'u':
+			Daemon::UnixSocket = optarg;
+			break;
+		case 'H':
+			Pch::Add(optarg);
+			break;
+		case 'l':
+			Compress::Level = atoi(optarg);
+			if (Compress::Level < 0 || Compress::Level > 9) {
+				throw std::runtime_error("Compression level must be 0 to 9");
+			}
+			break;
+		default:
+			throw std::runtime_error(
+					"Usage: AllKorrect [-w workers] [-b backlog] [-z zygotes] [-c] [-t workspace MB] [-p session threads] [-l compression level] [-u unix socket] [-H compiler:header:flags]...");
+		}
+	}
+}
+
+void Main(int argc, char* argv[]) {
+	parseOptions(argc, argv);
+
 	LOG("AllKorrect Starting up");
 	LOG("My uid=%d euid=%d gid=%d egid=%d",
 			getuid(), geteuid(), getgid(), getegid());
@@ -24,6 +70,7 @@ void Main() {
 	Daemon::Init();
 	Execute::Init();
 	FileSystem::Init();
+	Pch::Init();
 
 	//DBG("rnd: %s",RandString());
 
@@ -58,9 +105,9 @@ void Main() {
 	LOG("AllKorrect stopped.");
 }
 
-int main(void) {
+int main(int argc, char* argv[]) {
 	try {
-		Main();
+		Main(argc, argv);
 	} catch (std::runtime_error& e) {
 		ERR("Main Caught: %s", e.what());
 		perror(NULL);
@@ -0,0 +1,362 @@
+#include "BlobIndex.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <unordered_map>
+#include "Log.h"
+
+namespace BlobIndex {
+//The manifest is a header followed by records, each one change to the
+//index in the order it happened: op, size, lastUse, name and object length,
+//name, object. Save writes the index as PUTs, least recently used first.
+static const char MANIFEST_MAGIC[4] = { 'A', 'K', 'B', 'I' };
+static const uint32_t MANIFEST_VERSION = 1;
+static const size_t HEADER_SIZE = sizeof(MANIFEST_MAGIC)
+		+ sizeof(MANIFEST_VERSION);
+static const size_t RECORD_SIZE = 1 + 8 + 8 + 2 + 2;
+
+enum Op {
+	PUT = 1, ADD, REMOVE
+};
+
+//Most recently used first. Temporary blobs, named _..., only ever expire
+//by age, so they are kept apart from the cache.
+static std::list<Blob> temporary, cache;
+static std::unordered_map<std::string, std::list<Blob>::iterator> byName;
+static off_t cacheSize = 0;
+static pthread_mutex_t indexLock = PTHREAD_MUTEX_INITIALIZER;
+
+static std::string manifest;
+//Appended to, -1 until there is a manifest to append to
+static int journal = -1;
+//Whether the manifest is behind the index
+static bool dirty = false;
+//While Save writes a snapshot without the lock, the records it misses are
+//collected here and appended to it before it replaces the manifest
+static bool saving = false;
+static std::string missed;
+
+static std::list<Blob>& listOf(const std::string& name) {
+	return !name.empty() && name[0] == '_' ? temporary : cache;
+}
+
+static void append(std::string& buf, const void* data, size_t len) {
+	buf.append((const char*) data, len);
+}
+
+static void encode(std::string& buf, Op op, const Blob& blob) {
+	uint8_t code = op;
+	int64_t size = blob.size, lastUse = blob.lastUse;
+	uint16_t nameLen = blob.name.size(), objectLen = blob.object.size();
+	append(buf, &code, sizeof(code));
+	append(buf, &size, sizeof(size));
+	append(buf, &lastUse, sizeof(lastUse));
+	append(buf, &nameLen, sizeof(nameLen));
+	append(buf, &objectLen, sizeof(objectLen));
+	buf += blob.name;
+	buf += blob.object;
+}
+
+//Returns the length of the record at data, 0 when it is cut short
+static size_t decode(const char* data, size_t len, Op& op, Blob& blob) {
+	if (len < RECORD_SIZE) {
+		return 0;
+	}
+	uint8_t code;
+	int64_t size, lastUse;
+	uint16_t nameLen, objectLen;
+	memcpy(&code, data, sizeof(code));
+	memcpy(&size, data + 1, sizeof(size));
+	memcpy(&lastUse, data + 9, sizeof(lastUse));
+	memcpy(&nameLen, data + 17, sizeof(nameLen));
+	memcpy(&objectLen, data + 19, sizeof(objectLen));
+	if (code < PUT || code > REMOVE
+			|| len < RECORD_SIZE + nameLen + objectLen) {
+		return 0;
+	}
+	op = (Op) code;
+	blob.size = size;
+	blob.lastUse = lastUse;
+	blob.name.assign(data + RECORD_SIZE, nameLen);
+	blob.object.assign(data + RECORD_SIZE + nameLen, objectLen);
+	return RECORD_SIZE + nameLen + objectLen;
+}
+
+//Called with indexLock held
+static void record(Op op, const Blob& blob) {
+	dirty = true;
+	if (saving) {
+		encode(missed, op, blob);
+	}
+	if (journal < 0) {
+		return;
+	}
+	std::string buf;
+	encode(buf, op, blob);
+	if (write(journal, buf.data(), buf.size())
+			!= (ssize_t) buf.size()) {
+		//Whatever made it is cut off when read, the next Save catches up
+		ERR("Cannot append to blob manifest");
+		close(journal);
+		journal = -1;
+	}
+}
+
+//Called with indexLock held
+static std::string erase(const std::string& name) {
+	auto found = byName.find(name);
+	if (found == byName.end()) {
+		return "";
+	}
+	std::string object = found->second->object;
+	std::list<Blob>& list = listOf(name);
+	if (&list == &cache) {
+		cacheSize -= found->second->size;
+	}
+	list.erase(found->second);
+	byName.erase(found);
+	return object;
+}
+
+//Called with indexLock held
+static std::string insert(const Blob& blob, bool recent) {
+	std::string object = erase(blob.name);
+	std::list<Blob>& list = listOf(blob.name);
+	byName[blob.name] = list.insert(recent ? list.begin() : list.end(), blob);
+	if (&list == &cache) {
+		cacheSize += blob.size;
+	}
+	return object;
+}
+
+//Called with indexLock held
+static void replay(Op op, const Blob& blob) {
+	switch (op) {
+	case PUT:
+		insert(blob, true);
+		break;
+	case ADD:
+		if (byName.count(blob.name) == 0) {
+			insert(blob, false);
+		}
+		break;
+	case REMOVE:
+		erase(blob.name);
+		break;
+	}
+}
+
+bool Open(const std::string& path) {
+	pthread_mutex_lock(&indexLock);
+	manifest = path;
+	//Unless it is read below, the first Save is to write it
+	dirty = true;
+	int fd = open(path.c_str(), O_RDWR | O_APPEND | O_CLOEXEC);
+	if (fd < 0) {
+		pthread_mutex_unlock(&indexLock);
+		return false;
+	}
+	struct stat sts;
+	void* map = MAP_FAILED;
+	if (fstat(fd, &sts) == 0 && (size_t) sts.st_size >= HEADER_SIZE) {
+		map = mmap(NULL, sts.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	const char* data = (const char*) map;
+	uint32_t version = 0;
+	if (map != MAP_FAILED) {
+		memcpy(&version, data + sizeof(MANIFEST_MAGIC), sizeof(version));
+	}
+	if (map == MAP_FAILED
+			|| memcmp(data, MANIFEST_MAGIC, sizeof(MANIFEST_MAGIC)) != 0
+			|| version != MANIFEST_VERSION) {
+		if (map != MAP_FAILED) {
+			munmap(map, sts.st_size);
+		}
+		close(fd);
+		pthread_mutex_unlock(&indexLock);
+		return false;
+	}
+
+	size_t pos = HEADER_SIZE, len = sts.st_size;
+	//Names are short, so this is about one bucket per record
+	byName.reserve(len / (RECORD_SIZE + 16));
+	Op op;
+	Blob blob;
+	while (size_t used = decode(data + pos, len - pos, op, blob)) {
+		replay(op, blob);
+		pos += used;
+	}
+	munmap(map, sts.st_size);
+	//A record cut short by a crash would hide those appended after it
+	if (pos < len) {
+		ERR("Blob manifest cut short by %d bytes", (int) (len - pos));
+		if (ftruncate(fd, pos) < 0) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	journal = fd;
+	dirty = fd < 0;
+	pthread_mutex_unlock(&indexLock);
+	return true;
+}
+
+//Writes all or nothing of data to fd
+static bool writeAll(int fd, const std::string& data) {
+	size_t done = 0;
+	while (done < data.size()) {
+		ssize_t written = write(fd, data.data() + done, data.size() - done);
+		if (written <= 0) {
+			return false;
+		}
+		done += written;
+	}
+	return true;
+}
+
+//Only the snapshot is taken under the lock, the disk is written without it
+void Save() {
+	pthread_mutex_lock(&indexLock);
+	if (!dirty || manifest.empty() || saving) {
+		pthread_mutex_unlock(&indexLock);
+		return;
+	}
+	std::string buf(MANIFEST_MAGIC, sizeof(MANIFEST_MAGIC));
+	append(buf, &MANIFEST_VERSION, sizeof(MANIFEST_VERSION));
+	for (std::list<Blob>* list : { &temporary, &cache }) {
+		for (auto it = list->rbegin(); it != list->rend(); ++it) {
+			encode(buf, PUT, *it);
+		}
+	}
+	std::string tmp = manifest + ".tmp";
+	dirty = false;
+	saving = true;
+	missed.clear();
+	pthread_mutex_unlock(&indexLock);
+
+	int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	bool written = fd >= 0 && writeAll(fd, buf);
+
+	pthread_mutex_lock(&indexLock);
+	saving = false;
+	if (!written || !writeAll(fd, missed)
+			|| rename(tmp.c_str(), manifest.c_str()) < 0) {
+		ERR("Cannot save blob manifest");
+		if (fd >= 0) {
+			close(fd);
+			unlink(tmp.c_str());
+		}
+		dirty = true;
+		missed.clear();
+		pthread_mutex_unlock(&indexLock);
+		return;
+	}
+	missed.clear();
+	//Appends go on where the snapshot ends
+	if (journal >= 0) {
+		close(journal);
+	}
+	journal = fd;
+	if (fcntl(journal, F_SETFL, O_APPEND) < 0) {
+		close(journal);
+		journal = -1;
+	}
+	pthread_mutex_unlock(&indexLock);
+}
+
+std::string Put(const Blob& blob) {
+	pthread_mutex_lock(&indexLock);
+	std::string object = insert(blob, true);
+	record(PUT, blob);
+	pthread_mutex_unlock(&indexLock);
+	return object;
+}
+
+bool Add(const Blob& blob) {
+	pthread_mutex_lock(&indexLock);
+	bool added = byName.count(blob.name) == 0;
+	if (added) {
+		insert(blob, false);
+		record(ADD, blob);
+	}
+	pthread_mutex_unlock(&indexLock);
+	return added;
+}
+
+bool Use(const std::string& name, Blob* blob) {
+	pthread_mutex_lock(&indexLock);
+	auto found = byName.find(name);
+	bool has = found != byName.end();
+	if (has) {
+		std::list<Blob>& list = listOf(name);
+		list.splice(list.begin(), list, found->second);
+		found->second->lastUse = time(NULL);
+		//Too frequent to append, it is saved with the rest
+		dirty = true;
+		if (blob != NULL) {
+			*blob = *found->second;
+		}
+	}
+	pthread_mutex_unlock(&indexLock);
+	return has;
+}
+
+//Called with indexLock held
+static std::string forget(const std::string& name) {
+	if (byName.count(name) == 0) {
+		return "";
+	}
+	Blob blob;
+	blob.name = name;
+	blob.size = 0;
+	blob.lastUse = 0;
+	record(REMOVE, blob);
+	return erase(name);
+}
+
+std::string Remove(const std::string& name) {
+	pthread_mutex_lock(&indexLock);
+	std::string object = forget(name);
+	pthread_mutex_unlock(&indexLock);
+	return object;
+}
+
+std::vector<Blob> List() {
+	pthread_mutex_lock(&indexLock);
+	std::vector<Blob> blobs(temporary.begin(), temporary.end());
+	blobs.insert(blobs.end(), cache.begin(), cache.end());
+	pthread_mutex_unlock(&indexLock);
+	return blobs;
+}
+
+off_t CacheSize() {
+	pthread_mutex_lock(&indexLock);
+	off_t size = cacheSize;
+	pthread_mutex_unlock(&indexLock);
+	return size;
+}
+
+std::vector<Blob> Expire(double minAge, off_t maxCache) {
+	std::vector<Blob> expired;
+	time_t now = time(NULL);
+	pthread_mutex_lock(&indexLock);
+	while (!temporary.empty()
+			&& difftime(now, temporary.back().lastUse) > minAge) {
+		expired.push_back(temporary.back());
+		forget(expired.back().name);
+	}
+	while (cacheSize > maxCache && !cache.empty()
+			&& difftime(now, cache.back().lastUse) > minAge) {
+		expired.push_back(cache.back());
+		forget(expired.back().name);
+	}
+	pthread_mutex_unlock(&indexLock);
+	return expired;
+}
+}
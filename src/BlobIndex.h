@@ -0,0 +1,40 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <ctime>
+#include <sys/types.h>
+namespace BlobIndex {
+//What is known about a file in Root
+struct Blob {
+	//Relative to Root
+	std::string name;
+	off_t size;
+	time_t lastUse;
+	//Object a content addressed blob links to, relative to Root
+	std::string object;
+};
+
+//Reads the manifest at path back into the index and from then on appends
+//every change to it. False when there is no usable manifest, in which case
+//the index is to be filled and then saved.
+extern bool Open(const std::string& path);
+//Rewrites the manifest from the index, if anything changed since
+extern void Save();
+
+//Records a blob, replacing the one of the same name.
+//Returns the object the replaced one linked to.
+extern std::string Put(const Blob& blob);
+//Records a blob as the least recently used one, unless it is known already
+extern bool Add(const Blob& blob);
+//Looks a blob up and marks it as just used
+extern bool Use(const std::string& name, Blob* blob = NULL);
+//Forgets a blob, returns the object it linked to
+extern std::string Remove(const std::string& name);
+extern std::vector<Blob> List();
+//Bytes held by blobs other than the temporary ones
+extern off_t CacheSize();
+//Takes out the blobs to delete now: temporary blobs unused for minAge
+//seconds, and while the cache is larger than maxCache the least recently
+//used other ones, as long as they are unused for minAge as well
+extern std::vector<Blob> Expire(double minAge, off_t maxCache);
+}
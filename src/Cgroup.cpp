@@ -0,0 +1,184 @@
+#include "Cgroup.h"
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <atomic>
+#include "Log.h"
+
+namespace Cgroup {
+static const char* MOUNT = "/sys/fs/cgroup";
+
+bool Available;
+
+//Holds a cgroup per run, the daemon itself lives in its "daemon" child
+static std::string Base;
+static std::atomic<unsigned> groupCount(0);
+
+static bool writeFile(const std::string& name, const std::string& value) {
+	int fd = open(name.c_str(), O_WRONLY);
+	if (fd < 0) {
+		return false;
+	}
+	bool ok = ::write(fd, value.data(), value.size()) == (ssize_t) value.size();
+	close(fd);
+	return ok;
+}
+
+static std::string readFile(const std::string& name) {
+	std::ifstream fin(name.c_str());
+	std::ostringstream buf;
+	buf << fin.rdbuf();
+	return buf.str();
+}
+
+static bool hasFile(const std::string& name) {
+	return access(name.c_str(), F_OK) == 0;
+}
+
+static bool setUp() {
+	std::string controllers = readFile(std::string(MOUNT) + "/cgroup.controllers");
+	if (controllers.find("memory") == std::string::npos
+			|| controllers.find("pids") == std::string::npos) {
+		ERR("cgroup v2 with memory and pids controllers not mounted at %s",
+				MOUNT);
+		return false;
+	}
+
+	//0::/path/of/the/daemon
+	std::ifstream self("/proc/self/cgroup");
+	std::string line, own;
+	while (std::getline(self, line)) {
+		if (line.compare(0, 3, "0::") == 0) {
+			own = line.substr(3);
+		}
+	}
+	if (own.empty()) {
+		ERR("Cannot find the cgroup of the daemon");
+		return false;
+	}
+	if (*own.rbegin() != '/') {
+		own += '/';
+	}
+	Base = MOUNT + own;
+
+	//Processes may only live in leaves once controllers are enabled below
+	std::string leaf = Base + "daemon";
+	if (mkdir(leaf.c_str(), 0755) < 0 && errno != EEXIST) {
+		ERR("Cannot create cgroup %s", leaf.c_str());
+		return false;
+	}
+	if (!writeFile(leaf + "/cgroup.procs", "0")) {
+		ERR("Cannot move the daemon into %s", leaf.c_str());
+		return false;
+	}
+	if (!writeFile(Base + "cgroup.subtree_control", "+memory +pids")) {
+		ERR("Cannot enable memory and pids controllers in %s", Base.c_str());
+		return false;
+	}
+
+	//memory.peak and cgroup.kill need Linux 5.19
+	std::string probe = Base + "probe";
+	if (mkdir(probe.c_str(), 0755) < 0 && errno != EEXIST) {
+		return false;
+	}
+	bool complete = hasFile(probe + "/memory.peak")
+			&& hasFile(probe + "/cgroup.kill") && hasFile(probe + "/pids.max");
+	rmdir(probe.c_str());
+	if (!complete) {
+		ERR("cgroup v2 lacks memory.peak or cgroup.kill");
+	}
+	return complete;
+}
+
+void Init() {
+	Available = setUp();
+	if (Available) {
+		LOG("Runs are placed in cgroups under %s", Base.c_str());
+	} else {
+		LOG("cgroup v2 unavailable, falling back to rlimits");
+	}
+}
+
+Group::Group() {
+	char name[32];
+	sprintf(name, "run%d-%u", getpid(), groupCount++);
+	path = Base + name + '/';
+	if (mkdir(path.c_str(), 0755) < 0) {
+		throw std::runtime_error("Cannot create cgroup");
+	}
+	//Do not leave half of a killed run behind
+	write("memory.oom.group", "1");
+	if (hasFile(path + "memory.swap.max")) {
+		write("memory.swap.max", "0");
+	}
+}
+
+Group::~Group() {
+	if (rmdir(path.c_str()) < 0) {
+		Kill();
+		//The last processes of the group may still be exiting
+		for (int i = 0; i < 100 && rmdir(path.c_str()) < 0 && errno == EBUSY;
+				i++) {
+			usleep(1000);
+		}
+	}
+}
+
+void Group::write(const char* file, const std::string& value) {
+	if (!writeFile(path + file, value)) {
+		throw std::runtime_error(std::string("Cannot write cgroup ") + file);
+	}
+}
+
+std::string Group::read(const char* file) {
+	return readFile(path + file);
+}
+
+//Finds "key value" in a flat keyed file like cpu.stat
+long long Group::readKey(const char* file, const char* key) {
+	std::istringstream in(read(file));
+	std::string name;
+	long long value;
+	while (in >> name >> value) {
+		if (name == key) {
+			return value;
+		}
+	}
+	return 0;
+}
+
+void Group::SetMemoryLimit(long long bytes) {
+	write("memory.max", std::to_string(bytes));
+}
+
+void Group::SetProcessLimit(int processes) {
+	write("pids.max", std::to_string(processes));
+}
+
+void Group::Attach(pid_t pid) {
+	write("cgroup.procs", std::to_string(pid));
+}
+
+long long Group::MemoryPeak() {
+	return atoll(read("memory.peak").c_str());
+}
+
+long long Group::CpuTime() {
+	return readKey("cpu.stat", "usage_usec");
+}
+
+bool Group::OomKilled() {
+	return readKey("memory.events", "oom_kill") > 0;
+}
+
+void Group::Kill() {
+	writeFile(path + "cgroup.kill", "1");
+}
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include <sys/types.h>
+#include <string>
+namespace Cgroup {
+//Whether runs can be placed in their own cgroup v2
+extern bool Available;
+
+extern void Init();
+
+//A cgroup of a single run, removed on destruction
+class Group {
+	std::string path;
+	void write(const char* file, const std::string& value);
+	std::string read(const char* file);
+	long long readKey(const char* file, const char* key);
+public:
+	Group();
+	~Group();
+	//In bytes
+	void SetMemoryLimit(long long bytes);
+	void SetProcessLimit(int processes);
+	void Attach(pid_t pid);
+	//In bytes
+	long long MemoryPeak();
+	//User and system time of all processes, in us
+	long long CpuTime();
+	bool OomKilled();
+	void Kill();
+};
+}
@@ -0,0 +1,226 @@
+#include "Compare.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace Compare {
+//Longer tokens are never taken for numbers
+static const size_t MAX_NUMBER_LEN = 64;
+
+//A whole file mapped read only
+class Mapping {
+	Mapping(const Mapping&);
+	Mapping& operator=(const Mapping&);
+public:
+	const char* data;
+	size_t size;
+
+	Mapping(const std::string& path) :
+			data(""), size(0) {
+		int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			throw std::runtime_error("Cannot open blob to compare");
+		}
+		struct stat sts;
+		if (fstat(fd, &sts) < 0) {
+			close(fd);
+			throw std::runtime_error("Cannot get stat");
+		}
+		//mmap refuses empty files
+		if (sts.st_size > 0) {
+			void* map = mmap(NULL, sts.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (map == MAP_FAILED) {
+				close(fd);
+				throw std::runtime_error("Cannot map blob to compare");
+			}
+			madvise(map, sts.st_size, MADV_SEQUENTIAL);
+			data = (const char*) map;
+			size = sts.st_size;
+		}
+		close(fd);
+	}
+
+	~Mapping() {
+		if (size > 0) {
+			munmap((void*) data, size);
+		}
+	}
+};
+
+static inline bool isSpace(char c) {
+	return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+#ifdef __SSE2__
+//Bit i set when byte i is whitespace
+static inline unsigned spaceMask(__m128i bytes) {
+	//'\t'..'\r' are shifted to the lowest signed bytes, as SSE2 has no
+	//unsigned comparison
+	__m128i shifted = _mm_add_epi8(bytes, _mm_set1_epi8(0x80 - '\t'));
+	__m128i control = _mm_cmplt_epi8(shifted,
+			_mm_set1_epi8(-128 + '\r' - '\t' + 1));
+	__m128i blank = _mm_cmpeq_epi8(bytes, _mm_set1_epi8(' '));
+	return _mm_movemask_epi8(_mm_or_si128(control, blank));
+}
+#endif
+
+//Length of the common prefix of a and b
+static size_t commonPrefix(const char* a, const char* b, size_t len) {
+	size_t i = 0;
+#ifdef __SSE2__
+	//64 bytes a round while they are equal, then find the byte
+	for (; i + 64 <= len; i += 64) {
+		__m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (a + i)),
+				_mm_loadu_si128((const __m128i*) (b + i)));
+		for (size_t j = 16; j < 64; j += 16) {
+			eq = _mm_and_si128(eq,
+					_mm_cmpeq_epi8(
+							_mm_loadu_si128((const __m128i*) (a + i + j)),
+							_mm_loadu_si128((const __m128i*) (b + i + j))));
+		}
+		if (_mm_movemask_epi8(eq) != 0xFFFF) {
+			break;
+		}
+	}
+	for (; i + 16 <= len; i += 16) {
+		unsigned mask = _mm_movemask_epi8(
+				_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (a + i)),
+						_mm_loadu_si128((const __m128i*) (b + i))));
+		if (mask != 0xFFFF) {
+			return i + __builtin_ctz(~mask);
+		}
+	}
+#endif
+	while (i < len && a[i] == b[i]) {
+		i++;
+	}
+	return i;
+}
+
+//First offset from pos on whose byte isSpace is space, or len
+static size_t find(const char* data, size_t pos, size_t len, bool space) {
+#ifdef __SSE2__
+	for (; pos + 16 <= len; pos += 16) {
+		unsigned mask = spaceMask(
+				_mm_loadu_si128((const __m128i*) (data + pos)));
+		if (!space) {
+			mask ^= 0xFFFF;
+		}
+		if (mask != 0) {
+			return pos + __builtin_ctz(mask);
+		}
+	}
+#endif
+	while (pos < len && isSpace(data[pos]) != space) {
+		pos++;
+	}
+	return pos;
+}
+
+static bool toNumber(const char* token, size_t len, double& value) {
+	if (len > MAX_NUMBER_LEN) {
+		return false;
+	}
+	char buf[MAX_NUMBER_LEN + 1];
+	memcpy(buf, token, len);
+	buf[len] = '\0';
+	char* end;
+	value = strtod(buf, &end);
+	return end == buf + len && std::isfinite(value);
+}
+
+static bool sameToken(const char* a, size_t aLen, const char* b, size_t bLen,
+		bool numbers, double tolerance) {
+	if (aLen == bLen && memcmp(a, b, aLen) == 0) {
+		return true;
+	}
+	double x, y;
+	if (!numbers || !toNumber(a, aLen, x) || !toNumber(b, bLen, y)) {
+		return false;
+	}
+	double diff = std::fabs(x - y);
+	return diff <= tolerance
+			|| diff <= tolerance * std::max(std::fabs(x), std::fabs(y));
+}
+
+static Result differ(size_t expectedPos, size_t outputPos) {
+	Result result;
+	result.same = false;
+	result.expectedPos = expectedPos;
+	result.outputPos = outputPos;
+	return result;
+}
+
+static Result same() {
+	Result result;
+	result.same = true;
+	result.expectedPos = result.outputPos = -1;
+	return result;
+}
+
+static Result exact(const Mapping& expected, const Mapping& output) {
+	size_t pos = commonPrefix(expected.data, output.data,
+			std::min(expected.size, output.size));
+	if (pos == expected.size && pos == output.size) {
+		return same();
+	}
+	return differ(pos, pos);
+}
+
+static Result tokens(const Mapping& expected, const Mapping& output,
+		bool numbers, double tolerance) {
+	//Equal bytes are equal tokens, so only the token holding the first
+	//differing byte and those after it need to be split
+	size_t common = commonPrefix(expected.data, output.data,
+			std::min(expected.size, output.size));
+	if (common == expected.size && common == output.size) {
+		return same();
+	}
+	while (common > 0 && !isSpace(expected.data[common - 1])) {
+		common--;
+	}
+
+	size_t e = common, o = common;
+	for (;;) {
+		e = find(expected.data, e, expected.size, false);
+		o = find(output.data, o, output.size, false);
+		if (e == expected.size || o == output.size) {
+			if (e == expected.size && o == output.size) {
+				return same();
+			}
+			return differ(e, o);
+		}
+		size_t eEnd = find(expected.data, e, expected.size, true);
+		size_t oEnd = find(output.data, o, output.size, true);
+		if (!sameToken(expected.data + e, eEnd - e, output.data + o, oEnd - o,
+				numbers, tolerance)) {
+			return differ(e, o);
+		}
+		e = eEnd;
+		o = oEnd;
+	}
+}
+
+Result Files(const std::string& expected, const std::string& output,
+		Mode mode, double tolerance) {
+	Mapping expectedMap(expected), outputMap(output);
+	switch (mode) {
+	case EXACT:
+		return exact(expectedMap, outputMap);
+	case TOKEN:
+		return tokens(expectedMap, outputMap, false, 0);
+	case FLOAT:
+		return tokens(expectedMap, outputMap, true, tolerance);
+	}
+	throw std::runtime_error("Unknown compare mode");
+}
+}
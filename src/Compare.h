@@ -0,0 +1,23 @@
+#pragma once
+#include <string>
+namespace Compare {
+enum Mode {
+	//Byte for byte
+	EXACT,
+	//The same tokens, however they are separated by whitespace
+	TOKEN,
+	//As TOKEN, but numbers may differ by the tolerance, absolute or relative
+	FLOAT
+};
+
+struct Result {
+	bool same;
+	//Byte offsets of the first byte or token that differs, or of the end of
+	//the file that ran out first. -1 when the files are the same.
+	long long expectedPos, outputPos;
+};
+
+//Compares two files through memory maps, without reading them into buffers
+extern Result Files(const std::string& expected, const std::string& output,
+		Mode mode, double tolerance);
+}
@@ -0,0 +1,98 @@
+#include "Compile.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <stdexcept>
+#include "Defer.h"
+#include "Hash.h"
+#include "Schema.h"
+
+namespace Compile {
+//Changed whenever what goes into a key does, so that old entries miss
+static const int KEY_VERSION = 2;
+static const size_t READ_BUFFER_SIZE = 64 * 1024;
+
+//All of a key but the source
+struct Identity {
+	int version;
+	Message::MsgExec exec;
+	std::string sourceFile, outputFile;
+	//The compiler is known by its file, which an upgrade replaces
+	std::string compiler;
+	long long device, inode, size, modified;
+
+	template<typename Codec>
+	void Fields(Codec& codec) {
+		codec(version)(exec)(sourceFile)(outputFile)(compiler)(device)(inode)(
+				size)(modified);
+	}
+};
+
+std::string Key(const Message::MsgCompile& compile,
+		const std::string& source) {
+	//A relative one would be found from the workspace
+	if (compile.exec.cmd.empty() || compile.exec.cmd[0] != '/') {
+		return "";
+	}
+	char compiler[PATH_MAX];
+	struct stat sts;
+	if (realpath(compile.exec.cmd.c_str(), compiler) == NULL
+			|| stat(compiler, &sts) < 0) {
+		return "";
+	}
+	Identity identity;
+	identity.version = KEY_VERSION;
+	identity.exec = compile.exec;
+	identity.exec.input.clear();
+	identity.sourceFile = compile.sourceFile;
+	identity.outputFile = compile.outputFile;
+	identity.compiler = compiler;
+	identity.device = sts.st_dev;
+	identity.inode = sts.st_ino;
+	identity.size = sts.st_size;
+	identity.modified = sts.st_mtim.tv_sec * 1000000000LL
+			+ sts.st_mtim.tv_nsec;
+	std::vector<char> encoded;
+	Schema::Encode(identity, encoded);
+
+	//Sources come from clients, who must not be able to make theirs collide
+	//with another one and be handed its binary
+	Hash::SHA256 hash;
+	hash.Update(encoded.data(), encoded.size());
+	int fd = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		throw std::runtime_error("Cannot read source blob");
+	}
+	Defer fdCloser([=]() {
+		close(fd);
+	});
+	std::vector<char> buf(READ_BUFFER_SIZE);
+	ssize_t len;
+	while ((len = read(fd, &buf[0], buf.size())) > 0) {
+		hash.Update(&buf[0], len);
+	}
+	if (len < 0) {
+		throw std::runtime_error("Cannot read source blob");
+	}
+
+	unsigned char digest[Hash::SHA256::SIZE];
+	hash.Digest(digest);
+	std::string key;
+	for (unsigned char byte : digest) {
+		char hex[3];
+		snprintf(hex, sizeof(hex), "%02x", byte);
+		key += hex;
+	}
+	return key;
+}
+
+bool Repeatable(const Message::MsgExecReply& result) {
+	//A compile error is as repeatable as a success, running out of limits
+	//may depend on the load
+	return result.type == Execute::SUCCESS || result.type == Execute::FAILURE;
+}
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include <string>
+#include "Message.h"
+namespace Compile {
+//What is cached of a compilation besides its binary
+struct Record {
+	//Its output and error are unused, they are kept below
+	Message::MsgExecReply result;
+	std::string output, error;
+	//Whether the binary is cached as well
+	bool binary;
+
+	template<typename Codec>
+	void Fields(Codec& codec) {
+		codec(result)(output)(error)(binary);
+	}
+};
+
+//Identifies a compilation by all its result depends on: the content of the
+//source blob at path source, the compiler file, its arguments and limits,
+//and the file names. Empty when it cannot be cached, as when the compiler
+//is not given by an absolute path.
+extern std::string Key(const Message::MsgCompile& compile,
+		const std::string& source);
+
+//Whether the result of a compilation is the same every time it is run,
+//else it is not cached
+extern bool Repeatable(const Message::MsgExecReply& result);
+}
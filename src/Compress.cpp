@@ -0,0 +1,108 @@
+#include "Compress.h"
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include "Defer.h"
+
+namespace Compress {
+static const size_t BUFFER_SIZE = 64 * 1024;
+
+int Level = Z_BEST_SPEED;
+
+void Inflater::init() {
+	memset(&stream, 0, sizeof(stream));
+	if (inflateInit(&stream) != Z_OK) {
+		throw std::runtime_error("Cannot start inflating");
+	}
+}
+
+Inflater::Inflater(std::function<size_t(char* buf, size_t len)> _source) :
+		source(_source), in(BUFFER_SIZE), ended(false) {
+	init();
+}
+
+Inflater::Inflater(const char* data, size_t len) :
+		ended(false) {
+	init();
+	stream.next_in = (Bytef*) data;
+	stream.avail_in = len;
+}
+
+Inflater::~Inflater() {
+	inflateEnd(&stream);
+}
+
+size_t Inflater::Read(char* buf, size_t len) {
+	if (ended || len == 0) {
+		return 0;
+	}
+	stream.next_out = (Bytef*) buf;
+	stream.avail_out = len;
+	while (stream.avail_out == len) {
+		if (stream.avail_in == 0) {
+			size_t got = source ? source(&in[0], in.size()) : 0;
+			if (got == 0) {
+				throw std::runtime_error("Compressed data cut short");
+			}
+			stream.next_in = (Bytef*) &in[0];
+			stream.avail_in = got;
+		}
+		int ret = inflate(&stream, Z_NO_FLUSH);
+		if (ret == Z_STREAM_END) {
+			ended = true;
+			break;
+		}
+		if (ret != Z_OK && ret != Z_BUF_ERROR) {
+			throw std::runtime_error("Bad compressed data");
+		}
+	}
+	return len - stream.avail_out;
+}
+
+void File(int fd, size_t chunk,
+		std::function<void(const char* buf, size_t len)> write) {
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	if (deflateInit(&stream, Level) != Z_OK) {
+		throw std::runtime_error("Cannot start deflating");
+	}
+	Defer ender([&]() {
+		deflateEnd(&stream);
+	});
+
+	std::vector<char> in(BUFFER_SIZE), out(chunk);
+	stream.next_out = (Bytef*) &out[0];
+	stream.avail_out = out.size();
+	int flush = Z_NO_FLUSH;
+	for (;;) {
+		if (stream.avail_in == 0 && flush == Z_NO_FLUSH) {
+			ssize_t got = read(fd, &in[0], in.size());
+			if (got < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				throw std::runtime_error("Cannot read blob to compress");
+			}
+			if (got == 0) {
+				flush = Z_FINISH;
+			}
+			stream.next_in = (Bytef*) &in[0];
+			stream.avail_in = got;
+		}
+		int ret = deflate(&stream, flush);
+		if (ret == Z_STREAM_ERROR) {
+			throw std::runtime_error("Cannot compress blob");
+		}
+		//Full pieces go out as soon as they are, the last one at the end
+		if (stream.avail_out == 0 || ret == Z_STREAM_END) {
+			write(&out[0], out.size() - stream.avail_out);
+			stream.next_out = (Bytef*) &out[0];
+			stream.avail_out = out.size();
+		}
+		if (ret == Z_STREAM_END) {
+			return;
+		}
+	}
+}
+}
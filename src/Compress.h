@@ -0,0 +1,34 @@
+#pragma once
+#include <cstddef>
+#include <vector>
+#include <functional>
+#include <zlib.h>
+namespace Compress {
+//zlib level of compressed replies, 1 fastest to 9 smallest. At 0 replies
+//are never compressed.
+extern int Level;
+
+//Hands out what a zlib stream inflates to, reading the stream from source.
+//Both read up to len bytes per call and return 0 at the end, as
+//FileSystem::PutBlobStream takes them.
+class Inflater {
+	Inflater(const Inflater&);
+	Inflater& operator=(const Inflater&);
+	z_stream stream;
+	std::function<size_t(char* buf, size_t len)> source;
+	std::vector<char> in;
+	bool ended;
+	void init();
+public:
+	Inflater(std::function<size_t(char* buf, size_t len)> source);
+	//Inflates len bytes at data, which have to outlive it
+	Inflater(const char* data, size_t len);
+	~Inflater();
+	size_t Read(char* buf, size_t len);
+};
+
+//Compresses what is left of fd into one zlib stream at Level, handing it
+//to write in pieces of up to chunk bytes
+extern void File(int fd, size_t chunk,
+		std::function<void(const char* buf, size_t len)> write);
+}
@@ -2,32 +2,97 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <signal.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <cerrno>
+#include <cstdint>
+#include <algorithm>
 #include <cstring>
+#include <deque>
 #include <memory>
 #include <stdexcept>
 #include <string>
+#include <vector>
 #include <functional>
+#include <utility>
 #include "Log.h"
 #include "Message.h"
 #include "FileSystem.h"
 #include "Defer.h"
-#include "BinaryStream.h"
+#include "Compare.h"
+#include "Compile.h"
+#include "Compress.h"
+#include "Pch.h"
 
 namespace Daemon {
 static const short PORT = 10010;
-static const int MAX_PENDING = 5;
+//Largest chunk sent by GET_BLOB_STREAM
+static const off_t STREAM_CHUNK_SIZE = 64 * 1024 * 1024;
+//Largest piece of a compressed reply, which is built in memory
+static const size_t COMPRESSED_CHUNK_SIZE = 1024 * 1024;
+//A compressed GET_BLOB_REPLY is built whole in memory, so larger blobs are
+//sent as they are. GET_BLOB_STREAM compresses any size in chunks.
+static const off_t MAX_COMPRESSED_REPLY = 4 * 1024 * 1024;
+//Seconds a client may take to send a request or read a reply
+static const int CLIENT_TIMEOUT = 5;
 
-static bool Running;
+int Workers = 0;
+int Backlog = 64;
+int SessionThreads = 4;
+std::string UnixSocket = "/var/run/allkorrect.sock";
+
+static volatile bool Running;
+
+//Accepted clients waiting for a free worker
+static std::deque<int> pending;
+static pthread_mutex_t pendingLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pendingNotEmpty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pendingNotFull = PTHREAD_COND_INITIALIZER;
+
+//Runs going at once over all sessions are held to one per online CPU, or
+//runs sharing a core would be measured slower than they are
+static int cores;
+static int freeCores;
+static pthread_mutex_t coresLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t coreFreed = PTHREAD_COND_INITIALIZER;
+
+//Holds one of the cores for as long as it lives
+class Core {
+	Core(const Core&);
+	Core& operator=(const Core&);
+public:
+	Core() {
+		pthread_mutex_lock(&coresLock);
+		while (freeCores == 0) {
+			pthread_cond_wait(&coreFreed, &coresLock);
+		}
+		freeCores--;
+		pthread_mutex_unlock(&coresLock);
+	}
+	~Core() {
+		pthread_mutex_lock(&coresLock);
+		freeCores++;
+		pthread_cond_signal(&coreFreed);
+		pthread_mutex_unlock(&coresLock);
+	}
+};
 
 static void interruptHandler(int signo) {
 	LOG("Caught SIGINT! Stopping.");
 	Running = false;
 }
 
+//A client going away while sendfile runs raises SIGPIPE, which cannot be
+//suppressed per call like with send. Catching it rather than ignoring it
+//lets the sandboxed programs start with the default action again.
+static void pipeHandler(int signo) {
+}
+
 void Init() {
 	struct sigaction sigact;
 	memset(&sigact, 0, sizeof(struct sigaction));
@@ -38,53 +103,76 @@ void Init() {
 		throw std::runtime_error("Cannot register SIGINT handler");
 	}
 	LOG("Registered SIGINT handler");
+
+	memset(&sigact, 0, sizeof(struct sigaction));
+	sigact.sa_handler = pipeHandler;
+	if (sigaction(SIGPIPE, &sigact, NULL) < 0) {
+		throw std::runtime_error("Cannot register SIGPIPE handler");
+	}
 }
 
-void dealExec(int sock, std::string tmpDir, Message::Message& msg) {
-	Message::MsgExec exec = Message::ToMsgExec(msg);
+//One client connection. Tagged requests are handed to dispatch threads of
+//the session, so that each is answered as soon as it is done.
+struct Session {
+	int sock;
+	Message::Transport transport;
+	std::string tmpDir;
+	//Held while a reply is sent, frames of replies must not interleave
+	pthread_mutex_t sendLock;
 
-	//Input
-	bool hasInput = !exec.input.empty();
-	if (hasInput) {
-		FileSystem::CheckString(exec.input);
-		if (!FileSystem::HasBlob(FileSystem::Root + exec.input)) {
-			throw std::runtime_error("Input blob not found");
-		}
-		exec.input = FileSystem::Root + exec.input;
-		FileSystem::SetBlobReadOnly(exec.input);
+	pthread_mutex_t lock;
+	pthread_cond_t queued;
+	std::deque<Message::Message> queue;
+	std::vector<pthread_t> threads;
+	int idle;
+	//Tagged requests queued or being dealt with
+	int inFlight;
+	bool closing;
+
+	Session(int sock) :
+			sock(sock), transport(sock), idle(0), inFlight(0), closing(false) {
 	}
+};
+
+static void sendReply(Session& session, const Message::Message& request,
+		const Message::Message& reply) {
+	pthread_mutex_lock(&session.sendLock);
+	Defer unlocker([&]() {
+		pthread_mutex_unlock(&session.sendLock);
+	});
+	session.transport.Send(reply, request.tag);
+}
+
+//Runs exec.cmd in tmpDir with the given input blob path, or /dev/null if
+//input is empty, and returns the reply describing the run. Waits for a
+//free core first.
+static Message::MsgExecReply runExec(const std::string& tmpDir,
+		const Message::MsgExec& exec, const std::string& input,
+		Execute::Cancel* cancel = NULL) {
+	Core core;
 
 	//Output and Error
+	//Standard I/O is opened by the child before it drops root, so the
+	//blobs keep their 0700 permission and concurrent sessions sharing an
+	//input blob cannot race on chmod.
 	std::string out = FileSystem::RandString(), err = FileSystem::RandString();
 	std::string output = FileSystem::Root + out, error = FileSystem::Root + err;
 	FileSystem::NewBlob(output);
 	FileSystem::NewBlob(error);
-	FileSystem::SetBlobWriteOnly(output);
-	FileSystem::SetBlobWriteOnly(error);
-	Defer restorePermissions([=]() {
-		if(hasInput) {
-			FileSystem::RestoreBlobPermission(exec.input);
-		}
-		FileSystem::RestoreBlobPermission(output);
-		FileSystem::RestoreBlobPermission(error);
-	});
 
 	std::vector<char*> argv;
-	std::string cmdLine = exec.cmd;
 	argv.push_back((char*) exec.cmd.c_str());
-	for (int i = 0; i < exec.argc; i++) {
-		argv.push_back(const_cast<char*>(exec.arg[i].c_str()));
-		cmdLine += " " + exec.arg[i];
+	for (const std::string& arg : exec.arg) {
+		argv.push_back(const_cast<char*>(arg.c_str()));
 	}
-	LOG("EXEC %s", cmdLine.c_str());
 	argv.push_back(NULL);
 
 	Execute::Arg arg;
 	arg.command = exec.cmd.c_str();
 	arg.cwd = tmpDir.c_str();
 	arg.argv = &argv[0];
-	if (hasInput) {
-		arg.inputFile = exec.input.c_str();
+	if (!input.empty()) {
+		arg.inputFile = input.c_str();
 	} else {
 		arg.inputFile = "/dev/null";
 	}
@@ -95,6 +183,7 @@ void dealExec(int sock, std::string tmpDir, Message::Message& msg) {
 	arg.limit.timeLimit = exec.timeLimit;
 	arg.limit.memoryLimit = exec.memoryLimit;
 	arg.limit.outputLimit = exec.outputLimit;
+	arg.cancel = cancel;
 
 	switch (exec.restriction) {
 	case Message::STRICT:
@@ -109,92 +198,525 @@ void dealExec(int sock, std::string tmpDir, Message::Message& msg) {
 
 	Execute::Result execResult;
 	Execute::Execute(&arg, &execResult);
+	FileSystem::RefreshBlob(output);
+	FileSystem::RefreshBlob(error);
 	Message::MsgExecReply reply;
 	reply.error = err;
 	reply.output = out;
 	reply.exitStatus = execResult.exitStatus;
 	reply.memory = execResult.memory;
-	reply.time = execResult.time;
+	reply.time = execResult.time / 1000;
 	reply.type = execResult.type;
-	Message::Send(sock, Message::FromMsgExecReply(reply));
+	//Writes to the workspace failed once its quota was used up
+	if ((reply.type == Execute::FAILURE || reply.type == Execute::CRASHED)
+			&& FileSystem::WorkspaceFull(tmpDir)) {
+		reply.type = Execute::OLE;
+	}
+	return reply;
+}
+
+static std::string checkInput(const std::string& input) {
+	if (input.empty()) {
+		return input;
+	}
+	FileSystem::CheckString(input);
+	if (!FileSystem::HasBlob(FileSystem::Root + input)) {
+		throw std::runtime_error("Input blob not found");
+	}
+	return FileSystem::Root + input;
+}
+
+static std::string commandLine(const Message::MsgExec& exec) {
+	std::string cmdLine = exec.cmd;
+	for (const std::string& arg : exec.arg) {
+		cmdLine += " " + arg;
+	}
+	return cmdLine;
+}
+
+void dealExec(Session& session, Message::Message& msg) {
+	Message::MsgExec exec = Message::Decode<Message::MsgExec>(msg);
+	std::string input = checkInput(exec.input);
+	LOG("EXEC %s", commandLine(exec).c_str());
+	Pch::Inject(exec.cmd, exec.arg);
+	sendReply(session, msg,
+			Message::Encode(Message::EXEC_REPLY,
+					runExec(session.tmpDir, exec, input)));
 }
 
-void dealPutBlob(int sock, std::string tmpDir, Message::Message& msg) {
-	Message::MsgPutBlob putBlob = Message::ToMsgPutBlob(msg);
+//Shared state of the threads running one EXEC_BATCH
+struct Batch {
+	const std::string* tmpDir;
+	const Message::MsgExecBatch* msg;
+	std::vector<std::string> inputs;
+	std::vector<Message::MsgExecReply> replies;
+	//Of each input, so that the runs after a failure can be stopped
+	std::unique_ptr<Execute::Cancel[]> cancels;
+	size_t next; //first input not started yet
+	size_t failed; //first input whose run was not SUCCESS
+	std::string error;
+	pthread_mutex_t lock;
+};
+
+static void* batchThread(void* p) {
+	Batch& batch = *(Batch*) p;
+	for (;;) {
+		pthread_mutex_lock(&batch.lock);
+		size_t i = batch.next;
+		if (i >= batch.inputs.size()
+				|| (batch.msg->stopOnFailure && batch.failed < i)) {
+			pthread_mutex_unlock(&batch.lock);
+			break;
+		}
+		batch.next++;
+		pthread_mutex_unlock(&batch.lock);
+
+		try {
+			Message::MsgExecReply reply = runExec(*batch.tmpDir,
+					batch.msg->exec, batch.inputs[i], &batch.cancels[i]);
+			pthread_mutex_lock(&batch.lock);
+			batch.replies[i] = reply;
+			if (reply.type != Execute::SUCCESS && i < batch.failed) {
+				batch.failed = i;
+				//Their results would be thrown away
+				if (batch.msg->stopOnFailure) {
+					for (size_t j = i + 1; j < batch.next; j++) {
+						batch.cancels[j].Stop();
+					}
+				}
+			}
+			pthread_mutex_unlock(&batch.lock);
+		} catch (std::runtime_error& e) {
+			pthread_mutex_lock(&batch.lock);
+			batch.error = *e.what() ? e.what() : "Batch run failed";
+			batch.next = batch.inputs.size();
+			pthread_mutex_unlock(&batch.lock);
+			break;
+		}
+	}
+	return NULL;
+}
+
+void dealExecBatch(Session& session, Message::Message& msg) {
+	Message::MsgExecBatch execBatch = Message::Decode<
+			Message::MsgExecBatch>(msg);
+
+	Batch batch;
+	batch.tmpDir = &session.tmpDir;
+	batch.msg = &execBatch;
+	for (const std::string& input : execBatch.inputs) {
+		batch.inputs.push_back(checkInput(input));
+	}
+	batch.replies.resize(batch.inputs.size());
+	batch.cancels.reset(new Execute::Cancel[batch.inputs.size()]);
+	batch.next = 0;
+	batch.failed = batch.inputs.size();
+	pthread_mutex_init(&batch.lock, NULL);
+	Defer lockDestroyer([&]() {
+		pthread_mutex_destroy(&batch.lock);
+	});
+
+	//Every thread traces the runs it forks itself, so the runs are spread
+	//over one thread per core with the calling thread taking a share. The
+	//cores themselves are shared with every other session.
+	int threads = 1;
+	if (execBatch.parallel) {
+		threads = std::max(1, std::min(cores, (int) batch.inputs.size()));
+	}
+	LOG("EXEC_BATCH %s (%d inputs, %d threads)",
+			commandLine(execBatch.exec).c_str(), (int) batch.inputs.size(),
+			threads);
+
+	std::vector<pthread_t> helpers;
+	for (int i = 1; i < threads; i++) {
+		pthread_t helper;
+		if (pthread_create(&helper, NULL, batchThread, &batch) != 0) {
+			break;
+		}
+		helpers.push_back(helper);
+	}
+	batchThread(&batch);
+	for (pthread_t helper : helpers) {
+		pthread_join(helper, NULL);
+	}
+
+	//Runs started in parallel after the first failure are not reported
+	size_t count = batch.inputs.size();
+	if (execBatch.stopOnFailure && batch.failed < count) {
+		count = batch.failed + 1;
+	}
+	for (size_t i = count; i < batch.inputs.size(); i++) {
+		if (!batch.replies[i].output.empty()) {
+			FileSystem::RemoveBlob(
+					FileSystem::Root + batch.replies[i].output);
+			FileSystem::RemoveBlob(FileSystem::Root + batch.replies[i].error);
+		}
+	}
+	if (!batch.error.empty()) {
+		throw std::runtime_error(batch.error);
+	}
+	batch.replies.resize(count);
+	Message::MsgExecBatchReply reply;
+	reply.replies = std::move(batch.replies);
+	sendReply(session, msg, Message::Encode(Message::EXEC_BATCH_REPLY, reply));
+}
+
+void dealPutBlob(Session& session, Message::Message& msg) {
+	Message::MsgPutBlob putBlob = Message::Decode<Message::MsgPutBlob>(msg);
 	LOG("PUT_BLOB %s", putBlob.name.c_str());
 	FileSystem::CheckString(putBlob.name);
-	FileSystem::PutBlob(FileSystem::Root + putBlob.name, putBlob.buf,
-			putBlob.len);
+	if (msg.compressed) {
+		Compress::Inflater inflater(putBlob.data.data, putBlob.data.size);
+		FileSystem::PutBlobStream(FileSystem::Root + putBlob.name,
+				[&](char* buf, size_t len) {
+					return inflater.Read(buf, len);
+				});
+	} else {
+		FileSystem::PutBlob(FileSystem::Root + putBlob.name,
+				putBlob.data.data, putBlob.data.size);
+	}
 	Message::Message reply;
 	reply.type = Message::OK;
 	reply.size = 0;
-	Message::Send(sock, reply);
+	sendReply(session, msg, reply);
 }
 
-void dealGetBlob(int sock, std::string tmpDir, Message::Message& msg) {
-	Message::MsgGetBlob getBlob = Message::ToMsgGetBlob(msg);
+void dealGetBlob(Session& session, Message::Message& msg) {
+	Message::MsgGetBlob getBlob = Message::Decode<Message::MsgGetBlob>(msg);
 	LOG("GET_BLOB %s", getBlob.name.c_str());
 	FileSystem::CheckString(getBlob.name);
 	if (!FileSystem::HasBlob(FileSystem::Root + getBlob.name)) {
 		throw std::runtime_error("Blob not exists");
 	}
+	int fd = FileSystem::OpenBlob(FileSystem::Root + getBlob.name);
+	Defer fdCloser([=]() {
+		close(fd);
+	});
+	off_t size = FileSystem::BlobSize(fd);
+	if (msg.compressed && Compress::Level > 0 && size <= MAX_COMPRESSED_REPLY) {
+		//Compressed before taking the send lock
+		Message::Message reply;
+		reply.type = Message::GET_BLOB_REPLY;
+		reply.compressed = true;
+		Compress::File(fd, COMPRESSED_CHUNK_SIZE,
+				[&](const char* buf, size_t len) {
+					reply.body.insert(reply.body.end(), buf, buf + len);
+				});
+		reply.size = reply.body.size();
+		sendReply(session, msg, reply);
+		return;
+	}
+	if (size > UINT32_MAX) {
+		throw std::runtime_error("Blob too large, use GET_BLOB_STREAM");
+	}
+	pthread_mutex_lock(&session.sendLock);
+	Defer unlocker([&]() {
+		pthread_mutex_unlock(&session.sendLock);
+	});
+	session.transport.SendFile(Message::GET_BLOB_REPLY, fd, size, msg.tag);
+}
+
+void dealPutBlobStream(Session& session, Message::Message& msg) {
+	Message::MsgGetBlob putBlob = Message::Decode<Message::MsgGetBlob>(msg);
+	LOG("PUT_BLOB_STREAM %s", putBlob.name.c_str());
+	FileSystem::CheckString(putBlob.name);
+	Message::ChunkReader reader(session.transport);
+	std::function<size_t(char*, size_t)> read = [&](char* buf, size_t len) {
+		return reader.Read(buf, len);
+	};
+	if (msg.compressed) {
+		Compress::Inflater inflater(read);
+		FileSystem::PutBlobStream(FileSystem::Root + putBlob.name,
+				[&](char* buf, size_t len) {
+					return inflater.Read(buf, len);
+				});
+		//The chunk ending the upload may still be unread
+		char rest;
+		if (reader.Read(&rest, 1) > 0) {
+			throw std::runtime_error("Data after compressed stream");
+		}
+	} else {
+		FileSystem::PutBlobStream(FileSystem::Root + putBlob.name, read);
+	}
+	Message::Message reply;
+	reply.type = Message::OK;
+	reply.size = 0;
+	sendReply(session, msg, reply);
+}
+
+void dealGetBlobStream(Session& session, Message::Message& msg) {
+	Message::MsgGetBlob getBlob = Message::Decode<Message::MsgGetBlob>(msg);
+	LOG("GET_BLOB_STREAM %s", getBlob.name.c_str());
+	FileSystem::CheckString(getBlob.name);
+	if (!FileSystem::HasBlob(FileSystem::Root + getBlob.name)) {
+		throw std::runtime_error("Blob not exists");
+	}
+	int fd = FileSystem::OpenBlob(FileSystem::Root + getBlob.name);
+	Defer fdCloser([=]() {
+		close(fd);
+	});
+	off_t left = FileSystem::BlobSize(fd);
+	//No other reply may come between the chunks
+	pthread_mutex_lock(&session.sendLock);
+	Defer unlocker([&]() {
+		pthread_mutex_unlock(&session.sendLock);
+	});
+	if (msg.compressed && Compress::Level > 0) {
+		Compress::File(fd, COMPRESSED_CHUNK_SIZE,
+				[&](const char* buf, size_t len) {
+					session.transport.SendChunk(buf, len, msg.tag, true);
+				});
+		session.transport.SendChunk(NULL, 0, msg.tag, true);
+		return;
+	}
+	while (left > 0) {
+		uint32_t len = std::min(left, (off_t) STREAM_CHUNK_SIZE);
+		session.transport.SendFile(Message::BLOB_CHUNK, fd, len, msg.tag);
+		left -= len;
+	}
+	session.transport.SendChunk(NULL, 0, msg.tag);
+}
+
+//Copies the file passed along, such as a memfd, into a blob without the
+//data going through the socket
+void dealPutBlobFd(Session& session, Message::Message& msg) {
+	Message::MsgGetBlob putBlob = Message::Decode<Message::MsgGetBlob>(msg);
+	LOG("PUT_BLOB_FD %s", putBlob.name.c_str());
+	FileSystem::CheckString(putBlob.name);
+	int fd = msg.fd;
+	off_t offset = 0;
+	FileSystem::PutBlobStream(FileSystem::Root + putBlob.name,
+			[&](char* buf, size_t len) {
+				ssize_t got;
+				while ((got = pread(fd, buf, len, offset)) < 0) {
+					if (errno != EINTR) {
+						throw std::runtime_error("Cannot read passed file");
+					}
+				}
+				offset += got;
+				return (size_t) got;
+			});
+	Message::Message reply;
+	reply.type = Message::OK;
+	reply.size = 0;
+	sendReply(session, msg, reply);
+}
+
+//Passes the blob itself, opened read only, for the client to read or map
+void dealGetBlobFd(Session& session, Message::Message& msg) {
+	Message::MsgGetBlob getBlob = Message::Decode<Message::MsgGetBlob>(msg);
+	LOG("GET_BLOB_FD %s", getBlob.name.c_str());
+	FileSystem::CheckString(getBlob.name);
+	if (!FileSystem::HasBlob(FileSystem::Root + getBlob.name)) {
+		throw std::runtime_error("Blob not exists");
+	}
+	int fd = FileSystem::OpenBlob(FileSystem::Root + getBlob.name);
+	Defer fdCloser([=]() {
+		close(fd);
+	});
 	Message::Message reply;
-	reply.body = FileSystem::GetBlob(FileSystem::Root + getBlob.name);
-	reply.type = Message::GET_BLOB_REPLY;
-	reply.size = reply.body.size();
-	Message::Send(sock, reply);
+	reply.type = Message::GET_BLOB_FD_REPLY;
+	reply.size = 0;
+	pthread_mutex_lock(&session.sendLock);
+	Defer unlocker([&]() {
+		pthread_mutex_unlock(&session.sendLock);
+	});
+	session.transport.SendFd(reply, fd, msg.tag);
 }
 
-void dealCopyMove(int sock, std::string tmpDir, Message::Message& msg,
+void dealCopyMove(Session& session, Message::Message& msg,
 		void (*func)(std::string, std::string),
 		std::function<std::string(std::string)> oldToFull,
 		std::function<std::string(std::string)> newToFull) {
-	Message::MsgCopyMove copyMove = Message::ToMsgCopyMove(msg);
+	Message::MsgCopyMove copyMove = Message::Decode<Message::MsgCopyMove>(msg);
 	FileSystem::CheckString(copyMove.oldName);
 	FileSystem::CheckString(copyMove.newName);
 	func(oldToFull(copyMove.oldName), newToFull(copyMove.newName));
 	Message::Message reply;
 	reply.type = Message::OK;
 	reply.size = 0;
-	Message::Send(sock, reply);
+	sendReply(session, msg, reply);
 }
 
-void dealHasBlob(int sock, std::string tmpDir, Message::Message& msg) {
-	BinaryStream stream(msg.body);
-	std::string name;
-	stream >> name;
-	LOG("HAS_BLOB %s", name.c_str());
-	FileSystem::CheckString(name);
-	Message::Message reply;
-	BinaryStream buf;
-	if (FileSystem::HasBlob(FileSystem::Root + name)) {
-		buf << (int) 1;
-	} else {
-		buf << (int) 0;
+void dealHasBlob(Session& session, Message::Message& msg) {
+	Message::MsgGetBlob has = Message::Decode<Message::MsgGetBlob>(msg);
+	LOG("HAS_BLOB %s", has.name.c_str());
+	FileSystem::CheckString(has.name);
+	Message::MsgHasReply reply;
+	reply.has = FileSystem::HasBlob(FileSystem::Root + has.name);
+	sendReply(session, msg, Message::Encode(Message::HAS_BLOB_REPLY, reply));
+}
+
+void dealHasFile(Session& session, Message::Message& msg) {
+	Message::MsgGetBlob has = Message::Decode<Message::MsgGetBlob>(msg);
+	LOG("HAS_FILE %s", has.name.c_str());
+	FileSystem::CheckString(has.name);
+	Message::MsgHasReply reply;
+	reply.has = FileSystem::HasBlob(session.tmpDir + has.name);
+	sendReply(session, msg, Message::Encode(Message::HAS_FILE_REPLY, reply));
+}
+
+//Names the stored content with the given XXH64 and size, so the client
+//can skip uploading it
+void dealHasBlobByHash(Session& session, Message::Message& msg) {
+	Message::MsgHasBlobByHash has = Message::Decode<Message::MsgHasBlobByHash>(
+			msg);
+	LOG("HAS_BLOB_BY_HASH %s %016llx %lld", has.name.c_str(),
+			(unsigned long long) has.hash.value, has.size);
+	FileSystem::CheckString(has.name);
+	Message::MsgHasReply reply;
+	reply.has = FileSystem::LinkBlobByHash(FileSystem::Root + has.name,
+			has.hash.value, has.size);
+	sendReply(session, msg,
+			Message::Encode(Message::HAS_BLOB_BY_HASH_REPLY, reply));
+}
+
+//Checks an output against the expected one where both are, so that only
+//the verdict goes over the network
+void dealCompare(Session& session, Message::Message& msg) {
+	Message::MsgCompare compare = Message::Decode<Message::MsgCompare>(msg);
+	LOG("COMPARE %s %s %d %g", compare.expected.c_str(),
+			compare.output.c_str(), compare.mode, compare.tolerance);
+	FileSystem::CheckString(compare.expected);
+	FileSystem::CheckString(compare.output);
+	if (compare.mode < Compare::EXACT || compare.mode > Compare::FLOAT) {
+		throw std::runtime_error("Unknown compare mode");
+	}
+	if (!(compare.tolerance >= 0)) {
+		throw std::runtime_error("Tolerance must not be negative");
 	}
-	reply.type = Message::HAS_BLOB_REPLY;
-	reply.body = buf.buffer;
-	reply.size = reply.body.size();
-	Message::Send(sock, reply);
+	std::string expected = FileSystem::Root + compare.expected;
+	std::string output = FileSystem::Root + compare.output;
+	if (!FileSystem::HasBlob(expected) || !FileSystem::HasBlob(output)) {
+		throw std::runtime_error("Blob not exists");
+	}
+	Compare::Result result = Compare::Files(expected, output,
+			(Compare::Mode) compare.mode, compare.tolerance);
+
+	Message::MsgCompareReply reply;
+	reply.same = result.same;
+	reply.expectedPos = result.expectedPos;
+	reply.outputPos = result.outputPos;
+	sendReply(session, msg, Message::Encode(Message::COMPARE_REPLY, reply));
 }
 
-void dealHasFile(int sock, std::string tmpDir, Message::Message& msg) {
-	BinaryStream stream(msg.body);
-	std::string name;
-	stream >> name;
-	LOG("HAS_FILE %s", name.c_str());
-	FileSystem::CheckString(name);
-	Message::Message reply;
-	BinaryStream buf;
-	if (FileSystem::HasBlob(tmpDir + name)) {
-		buf << (int) 1;
+//Compilations with more output and error than this together are not cached
+static const size_t MAX_CACHED_OUTPUT = 1024 * 1024;
+
+//Reads a blob the compiler wrote into data, unless it is larger than limit
+static bool readOutput(const std::string& blob, size_t limit,
+		std::string& data) {
+	int fd = FileSystem::OpenBlob(FileSystem::Root + blob);
+	Defer fdCloser([=]() {
+		close(fd);
+	});
+	off_t size = FileSystem::BlobSize(fd);
+	if (size > (off_t) limit) {
+		return false;
+	}
+	data.resize(size);
+	size_t done = 0;
+	while (done < data.size()) {
+		ssize_t got = pread(fd, &data[done], data.size() - done, done);
+		if (got < 0 && errno == EINTR) {
+			continue;
+		}
+		if (got < 0) {
+			throw std::runtime_error("Cannot read compiler output");
+		}
+		if (got == 0) {
+			data.resize(done);
+			break;
+		}
+		done += got;
+	}
+	return true;
+}
+
+//Stores messages of a cached compilation as a new blob
+static std::string putOutput(const std::string& data) {
+	std::string name = FileSystem::RandString();
+	FileSystem::PutBlob(FileSystem::Root + name, data.data(), data.size());
+	return name;
+}
+
+//Answers from the cache what it can, else compiles in the workspace and
+//caches the result for the next identical request
+void dealCompile(Session& session, Message::Message& msg) {
+	Message::MsgCompile compile = Message::Decode<Message::MsgCompile>(msg);
+	LOG("COMPILE %s %s", compile.source.c_str(),
+			commandLine(compile.exec).c_str());
+	FileSystem::CheckString(compile.source);
+	FileSystem::CheckString(compile.sourceFile);
+	FileSystem::CheckString(compile.outputFile);
+	FileSystem::CheckString(compile.binary);
+	std::string source = FileSystem::Root + compile.source;
+	std::string binary = FileSystem::Root + compile.binary;
+	if (!FileSystem::HasBlob(source)) {
+		throw std::runtime_error("Source blob not found");
+	}
+	std::string key = Compile::Key(compile, source);
+
+	Message::MsgCompileReply reply;
+	std::vector<char> cached;
+	if (!key.empty() && FileSystem::ReadCompiled(key, cached)) {
+		Compile::Record record;
+		bool usable = false;
+		try {
+			record = Schema::Decode<Compile::Record>(cached);
+			usable = true;
+		} catch (std::runtime_error& e) {
+			//Compiled again below
+			ERR("Bad compile cache entry %s: %s", key.c_str(), e.what());
+		}
+		if (usable
+				&& (!record.binary || FileSystem::LinkCompiled(key, binary))) {
+			reply.result = record.result;
+			reply.result.output = putOutput(record.output);
+			reply.result.error = putOutput(record.error);
+			reply.cached = true;
+			LOG("COMPILE cached %s", key.c_str());
+			sendReply(session, msg,
+					Message::Encode(Message::COMPILE_REPLY, reply));
+			return;
+		}
+	}
+
+	std::string sourceFile = session.tmpDir + compile.sourceFile;
+	std::string outputFile = session.tmpDir + compile.outputFile;
+	unlink(outputFile.c_str());
+	FileSystem::CopyBlob2File(source, sourceFile);
+	Defer sourceRemover([&]() {
+		unlink(sourceFile.c_str());
+	});
+	//Not part of the key, the header sets only make it faster
+	Pch::Inject(compile.exec.cmd, compile.exec.arg);
+	reply.result = runExec(session.tmpDir, compile.exec, "");
+	reply.cached = false;
+	struct stat sts;
+	bool hasBinary = lstat(outputFile.c_str(), &sts) == 0
+			&& S_ISREG(sts.st_mode);
+	if (hasBinary) {
+		FileSystem::MoveFile2Blob(outputFile, binary);
 	} else {
-		buf << (int) 0;
+		unlink(outputFile.c_str());
+	}
+
+	if (!key.empty() && Compile::Repeatable(reply.result)) {
+		Compile::Record record;
+		record.result = reply.result;
+		record.binary = hasBinary;
+		//Sized up before they are read, a compiler may print a lot
+		if (readOutput(reply.result.output, MAX_CACHED_OUTPUT, record.output)
+				&& readOutput(reply.result.error,
+						MAX_CACHED_OUTPUT - record.output.size(),
+						record.error)) {
+			std::vector<char> encoded;
+			Schema::Encode(record, encoded);
+			FileSystem::PutCompiled(key, encoded, hasBinary ? binary : "");
+		}
 	}
-	reply.type = Message::HAS_FILE_REPLY;
-	reply.body = buf.buffer;
-	reply.size = reply.body.size();
-	Message::Send(sock, reply);
+	sendReply(session, msg, Message::Encode(Message::COMPILE_REPLY, reply));
 }
 
 std::string toFullBlob(std::string a) {
@@ -207,92 +729,354 @@ std::function<std::string(std::string)> toFullFile(std::string tmpDir) {
 	};
 }
 
+static void deal(Session& session, Message::Message& msg) {
+	Defer fdCloser([&]() {
+		if (msg.fd >= 0) {
+			close(msg.fd);
+			msg.fd = -1;
+		}
+	});
+	if (msg.compressed && msg.type != Message::PUT_BLOB
+			&& msg.type != Message::GET_BLOB
+			&& msg.type != Message::PUT_BLOB_STREAM
+			&& msg.type != Message::GET_BLOB_STREAM) {
+		throw std::runtime_error("Message type cannot be compressed");
+	}
+	switch (msg.type) {
+	case Message::EXEC:
+		dealExec(session, msg);
+		break;
+	case Message::EXEC_BATCH:
+		dealExecBatch(session, msg);
+		break;
+	case Message::PUT_BLOB:
+		dealPutBlob(session, msg);
+		break;
+	case Message::GET_BLOB:
+		dealGetBlob(session, msg);
+		break;
+	case Message::PUT_BLOB_STREAM:
+		dealPutBlobStream(session, msg);
+		break;
+	case Message::GET_BLOB_STREAM:
+		dealGetBlobStream(session, msg);
+		break;
+	case Message::PUT_BLOB_FD:
+		dealPutBlobFd(session, msg);
+		break;
+	case Message::GET_BLOB_FD:
+		dealGetBlobFd(session, msg);
+		break;
+	case Message::HAS_BLOB:
+		dealHasBlob(session, msg);
+		break;
+	case Message::HAS_BLOB_BY_HASH:
+		dealHasBlobByHash(session, msg);
+		break;
+	case Message::HAS_FILE:
+		dealHasFile(session, msg);
+		break;
+	case Message::COMPARE:
+		dealCompare(session, msg);
+		break;
+	case Message::COMPILE:
+		dealCompile(session, msg);
+		break;
+	case Message::MOVE_BLOB2FILE:
+		dealCopyMove(session, msg, FileSystem::MoveBlob2File,
+				toFullBlob, toFullFile(session.tmpDir));
+		break;
+	case Message::MOVE_BLOB2BLOB:
+		dealCopyMove(session, msg, FileSystem::MoveBlob2Blob,
+				toFullBlob, toFullBlob);
+		break;
+	case Message::MOVE_FILE2FILE:
+		dealCopyMove(session, msg, FileSystem::MoveFile2File,
+				toFullFile(session.tmpDir), toFullFile(session.tmpDir));
+		break;
+	case Message::MOVE_FILE2BLOB:
+		dealCopyMove(session, msg, FileSystem::MoveFile2Blob,
+				toFullFile(session.tmpDir), toFullBlob);
+		break;
+	case Message::COPY_BLOB2FILE:
+		dealCopyMove(session, msg, FileSystem::CopyBlob2File,
+				toFullBlob, toFullFile(session.tmpDir));
+		break;
+	case Message::COPY_BLOB2BLOB:
+		dealCopyMove(session, msg, FileSystem::CopyBlob2Blob,
+				toFullBlob, toFullBlob);
+		break;
+	case Message::COPY_FILE2FILE:
+		dealCopyMove(session, msg, FileSystem::CopyFile2File,
+				toFullFile(session.tmpDir), toFullFile(session.tmpDir));
+		break;
+	case Message::COPY_FILE2BLOB:
+		dealCopyMove(session, msg, FileSystem::CopyFile2Blob,
+				toFullFile(session.tmpDir), toFullBlob);
+		break;
+	default:
+		throw std::runtime_error("Unknown message type.");
+	}
+}
+
+//Called with session.lock held
+static void dropQueue(Session& session) {
+	session.inFlight -= session.queue.size();
+	for (Message::Message& msg : session.queue) {
+		if (msg.fd >= 0) {
+			close(msg.fd);
+		}
+	}
+	session.queue.clear();
+}
+
+static void* dispatchThread(void* p) {
+	Session& session = *(Session*) p;
+	pthread_mutex_lock(&session.lock);
+	for (;;) {
+		while (session.queue.empty() && !session.closing) {
+			pthread_cond_wait(&session.queued, &session.lock);
+		}
+		if (session.queue.empty()) {
+			break;
+		}
+		Message::Message msg = std::move(session.queue.front());
+		session.queue.pop_front();
+		session.idle--;
+		pthread_mutex_unlock(&session.lock);
+
+		bool failed = false;
+		try {
+			deal(session, msg);
+		} catch (std::runtime_error& e) {
+			if (*e.what()) {
+				ERR("%s", e.what());
+			}
+			failed = true;
+		}
+
+		pthread_mutex_lock(&session.lock);
+		session.idle++;
+		session.inFlight--;
+		if (failed) {
+			//Ends the session as a failed untagged request does, the reading
+			//thread wakes up to a shut down socket
+			dropQueue(session);
+			session.closing = true;
+			shutdown(session.sock, SHUT_RDWR);
+		}
+	}
+	pthread_mutex_unlock(&session.lock);
+	return NULL;
+}
+
+static void dispatch(Session& session, Message::Message& msg) {
+	pthread_mutex_lock(&session.lock);
+	//Idle threads may not have taken what is queued already
+	if (session.idle <= (int) session.queue.size()
+			&& (int) session.threads.size() < SessionThreads) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, dispatchThread, &session) == 0) {
+			session.threads.push_back(thread);
+			session.idle++;
+		}
+	}
+	if (session.threads.empty()) {
+		pthread_mutex_unlock(&session.lock);
+		deal(session, msg);
+		return;
+	}
+	//The reading thread is done with it
+	session.queue.push_back(std::move(msg));
+	session.inFlight++;
+	pthread_cond_signal(&session.queued);
+	pthread_mutex_unlock(&session.lock);
+}
+
+//While tagged requests are pending, the client may stay quiet for as long
+//as it likes, else the recv timeout applies
+static void waitRequest(Session& session) {
+	for (;;) {
+		pthread_mutex_lock(&session.lock);
+		bool pending = session.inFlight > 0;
+		pthread_mutex_unlock(&session.lock);
+		if (!pending || session.transport.Buffered()) {
+			return;
+		}
+		struct pollfd readable = { session.sock, POLLIN, 0 };
+		if (poll(&readable, 1, CLIENT_TIMEOUT * 1000) != 0) {
+			return;
+		}
+	}
+}
+
 void serve(int sock) {
 	Defer sockCloser([=]() {
 		LOG("Client socket closed.");
 		close(sock);
 	});
 
+	Session session(sock);
+
 	//Create a temp directory
-	std::string tmpDir = FileSystem::NewTmpDir();
-	LOG("Use tmp dir %s", tmpDir.c_str());
+	session.tmpDir = FileSystem::NewTmpDir();
+	LOG("Use tmp dir %s", session.tmpDir.c_str());
 
-	Defer rmTmpDir([=]() {
-		FileSystem::RecursiveRemove(tmpDir);
+	Defer rmTmpDir([&]() {
+		FileSystem::RemoveTmpDir(session.tmpDir);
 	});
 
-	for (;;) {
-		Message::Message msg = Message::Next(sock);
+	pthread_mutex_init(&session.sendLock, NULL);
+	pthread_mutex_init(&session.lock, NULL);
+	pthread_cond_init(&session.queued, NULL);
+	bool normalExit = false;
+	//Tagged requests still queued are answered on EXIT, and dropped when
+	//the session fails
+	Defer dispatchStopper([&]() {
+		pthread_mutex_lock(&session.lock);
+		if (!normalExit) {
+			dropQueue(session);
+		}
+		session.closing = true;
+		pthread_cond_broadcast(&session.queued);
+		pthread_mutex_unlock(&session.lock);
+		for (pthread_t thread : session.threads) {
+			pthread_join(thread, NULL);
+		}
+		pthread_cond_destroy(&session.queued);
+		pthread_mutex_destroy(&session.lock);
+		pthread_mutex_destroy(&session.sendLock);
+	});
 
-		switch (msg.type) {
-		case Message::EXIT:
-			goto EndSession;
-		case Message::EXEC:
-			dealExec(sock, tmpDir, msg);
-			break;
-		case Message::PUT_BLOB:
-			dealPutBlob(sock, tmpDir, msg);
-			break;
-		case Message::GET_BLOB:
-			dealGetBlob(sock, tmpDir, msg);
-			break;
-		case Message::HAS_BLOB:
-			dealHasBlob(sock, tmpDir, msg);
-			break;
-		case Message::HAS_FILE:
-			dealHasFile(sock, tmpDir, msg);
-			break;
-		case Message::MOVE_BLOB2FILE:
-			dealCopyMove(sock, tmpDir, msg, FileSystem::MoveBlob2File,
-					toFullBlob, toFullFile(tmpDir));
-			break;
-		case Message::MOVE_BLOB2BLOB:
-			dealCopyMove(sock, tmpDir, msg, FileSystem::MoveBlob2Blob,
-					toFullBlob, toFullBlob);
-			break;
-		case Message::MOVE_FILE2FILE:
-			dealCopyMove(sock, tmpDir, msg, FileSystem::MoveFile2File,
-					toFullFile(tmpDir), toFullFile(tmpDir));
-			break;
-		case Message::MOVE_FILE2BLOB:
-			dealCopyMove(sock, tmpDir, msg, FileSystem::MoveFile2Blob,
-					toFullFile(tmpDir), toFullBlob);
-			break;
-		case Message::COPY_BLOB2FILE:
-			dealCopyMove(sock, tmpDir, msg, FileSystem::CopyBlob2File,
-					toFullBlob, toFullFile(tmpDir));
-			break;
-		case Message::COPY_BLOB2BLOB:
-			dealCopyMove(sock, tmpDir, msg, FileSystem::CopyBlob2Blob,
-					toFullBlob, toFullBlob);
-			break;
-		case Message::COPY_FILE2FILE:
-			dealCopyMove(sock, tmpDir, msg, FileSystem::CopyFile2File,
-					toFullFile(tmpDir), toFullFile(tmpDir));
-			break;
-		case Message::COPY_FILE2BLOB:
-			dealCopyMove(sock, tmpDir, msg, FileSystem::CopyFile2Blob,
-					toFullFile(tmpDir), toFullBlob);
+	Message::Message msg;
+	for (;;) {
+		waitRequest(session);
+		session.transport.Next(msg);
+		if (msg.type == Message::EXIT) {
 			break;
-		default:
-			throw std::runtime_error("Unknown message type.");
+		}
+		//The chunks of a stream follow on the socket, so it is read here
+		if (msg.tag.tagged && msg.type != Message::PUT_BLOB_STREAM) {
+			dispatch(session, msg);
+		} else {
+			deal(session, msg);
+			//Runs of the requests dealt with here are traced by this thread
+			Execute::FillPool();
 		}
 	}
-	EndSession:
+	normalExit = true;
 	LOG("Client normal exit");
 }
 
+static void setTimeouts(int client) {
+	struct timeval timeout;
+	timeout.tv_sec = CLIENT_TIMEOUT;
+	timeout.tv_usec = 0;
+	if (setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout))
+			< 0) {
+		throw std::runtime_error("Cannot set recv timeout");
+	}
+	if (setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout))
+			< 0) {
+		throw std::runtime_error("Cannot set send timeout");
+	}
+}
+
+static void* workerThread(void*) {
+	for (;;) {
+		int client;
+
+		//Runs of this worker's sessions are traced by this very thread
+		Execute::FillPool();
+
+		pthread_mutex_lock(&pendingLock);
+		while (Running && pending.empty()) {
+			pthread_cond_wait(&pendingNotEmpty, &pendingLock);
+		}
+		if (pending.empty()) {
+			pthread_mutex_unlock(&pendingLock);
+			break;
+		}
+		client = pending.front();
+		pending.pop_front();
+		pthread_cond_signal(&pendingNotFull);
+		pthread_mutex_unlock(&pendingLock);
+
+		try {
+			setTimeouts(client);
+			serve(client);
+		} catch (std::runtime_error& e) {
+			if (*e.what()) {
+				ERR("%s", e.what());
+				perror(NULL);
+			}
+		} catch (...) {
+			ERR("Unkown exception throwed");
+		}
+	}
+	return NULL;
+}
+
+//Listens on UnixSocket as well, for clients on this host, -1 for none
+static int listenUnix() {
+	if (UnixSocket.empty()) {
+		return -1;
+	}
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (UnixSocket.size() >= sizeof(addr.sun_path)) {
+		throw std::runtime_error("Unix socket path too long");
+	}
+	strcpy(addr.sun_path, UnixSocket.c_str());
+
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (sock < 0) {
+		throw std::runtime_error("Cannot create unix socket");
+	}
+	//Left over by a daemon that did not stop cleanly
+	unlink(UnixSocket.c_str());
+	if (bind(sock, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+		close(sock);
+		throw std::runtime_error("Cannot bind unix socket");
+	}
+	//Whoever may reach the TCP port may connect here as well
+	chmod(UnixSocket.c_str(), 0666);
+	if (listen(sock, Backlog) < 0) {
+		close(sock);
+		throw std::runtime_error("Cannot listen on unix socket");
+	}
+	LOG("Listening at %s", UnixSocket.c_str());
+	return sock;
+}
+
 void Run() {
 	LOG("Starting up daemon");
 	LOG("Listening at %d", PORT);
 
 	Running = true;
 
+	if (Workers <= 0) {
+		Workers = sysconf(_SC_NPROCESSORS_ONLN);
+		if (Workers <= 0) {
+			Workers = 1;
+		}
+	}
+	if (Backlog <= 0) {
+		Backlog = 1;
+	}
+	cores = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+	freeCores = cores;
+
 	int sock;
-	if ((sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
+	if ((sock = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP))
+			< 0) {
 		throw std::runtime_error("Cannot create server socket");
 	}
 
+	int reuse = 1;
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
 	struct sockaddr_in serverAddr;
 	memset(&serverAddr, 0, sizeof(serverAddr));
 	serverAddr.sin_family = AF_INET;
@@ -302,50 +1086,93 @@ void Run() {
 		throw std::runtime_error("Cannot bind server socket");
 	}
 
-	if (listen(sock, MAX_PENDING) < 0) {
+	if (listen(sock, Backlog) < 0) {
 		throw std::runtime_error("Cannot listen");
 	}
 
+	int unixSock = listenUnix();
+
 	LOG("Successfully listened.");
+
+	//Only the accepting thread should be interrupted by SIGINT
+	sigset_t blocked, old;
+	sigemptyset(&blocked);
+	sigaddset(&blocked, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &blocked, &old);
+	std::vector<pthread_t> workers(Workers);
+	for (pthread_t& worker : workers) {
+		if (pthread_create(&worker, NULL, workerThread, NULL) != 0) {
+			throw std::runtime_error("Cannot create worker thread");
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	LOG("Started %d workers, backlog %d, %d runs at once", Workers, Backlog,
+			cores);
+
 	while (Running) {
 		int client;
 		struct sockaddr_in clientAddr;
-		socklen_t sockLen;
+		socklen_t sockLen = sizeof(clientAddr);
+
+		//Leave further clients in the listen queue while all workers are busy
+		pthread_mutex_lock(&pendingLock);
+		while (Running && (int) pending.size() >= Backlog) {
+			pthread_cond_wait(&pendingNotFull, &pendingLock);
+		}
+		pthread_mutex_unlock(&pendingLock);
+		if (!Running)
+			break;
 
 		LOG("Waiting for the next client.");
-		client = accept(sock, (struct sockaddr*) &clientAddr, &sockLen);
+		//The listening sockets do not block, a client may be gone already
+		struct pollfd listeners[2] = { { sock, POLLIN, 0 },
+				{ unixSock, POLLIN, 0 } };
+		if (poll(listeners, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			else
+				throw std::runtime_error("Poll failure");
+		}
+		if (listeners[0].revents) {
+			client = accept(sock, (struct sockaddr*) &clientAddr, &sockLen);
+		} else {
+			client = accept(unixSock, NULL, NULL);
+		}
 		if (client < 0) {
 			if (!Running)
 				break;
+			else if (errno == EINTR || errno == ECONNABORTED
+					|| errno == EAGAIN)
+				continue;
 			else
 				throw std::runtime_error("Accept failure");
 		}
-		LOG("Client connected from %s:%hu",
-				inet_ntoa(clientAddr.sin_addr), ntohs(clientAddr.sin_port));
-
-		try {
-			struct timeval timeout;
-			timeout.tv_sec = 5;
-			timeout.tv_usec = 0;
-			if (setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout,
-					sizeof(timeout)) < 0) {
-				throw std::runtime_error("Cannot set recv timeout");
-			}
-			if (setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout,
-					sizeof(timeout)) < 0) {
-				throw std::runtime_error("Cannot set send timeout");
-			}
-			serve(client);
-		} catch (std::runtime_error& e) {
-			if (*e.what()) {
-				ERR("%s", e.what());
-				perror(NULL);
-			}
-		} catch (...) {
-			ERR("Unkown exception throwed");
+		if (listeners[0].revents) {
+			LOG("Client connected from %s:%hu",
+					inet_ntoa(clientAddr.sin_addr), ntohs(clientAddr.sin_port));
+		} else {
+			LOG("Client connected at %s", UnixSocket.c_str());
 		}
+
+		pthread_mutex_lock(&pendingLock);
+		pending.push_back(client);
+		pthread_cond_signal(&pendingNotEmpty);
+		pthread_mutex_unlock(&pendingLock);
 	}
 	close(sock);
+	if (unixSock >= 0) {
+		close(unixSock);
+		unlink(UnixSocket.c_str());
+	}
 	LOG("Server socket closed");
+
+	//Let the workers finish the sessions already accepted
+	pthread_mutex_lock(&pendingLock);
+	pthread_cond_broadcast(&pendingNotEmpty);
+	pthread_mutex_unlock(&pendingLock);
+	for (pthread_t& worker : workers) {
+		pthread_join(worker, NULL);
+	}
+	LOG("All workers stopped");
 }
 }
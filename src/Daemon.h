@@ -1,5 +1,16 @@
 #pragma once
+#include <string>
 namespace Daemon {
+//Number of concurrent sessions, 0 for one per online CPU
+extern int Workers;
+//Connections allowed to wait for a free worker
+extern int Backlog;
+//Threads of a session dealing with tagged requests at the same time
+extern int SessionThreads;
+//Path of the Unix domain socket listened on besides the TCP port, where
+//files can be passed instead of their data. Empty for none.
+extern std::string UnixSocket;
+
 extern void Init();
 extern void Run();
 }
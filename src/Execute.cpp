@@ -1,11 +1,19 @@
 #include "Execute.h"
 #include <unistd.h>
-#include <dirent.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <sys/signal.h>
 #include <sys/ptrace.h>
 #include <sys/syscall.h>
 #include <sys/user.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <fcntl.h>
+#include <climits>
+#include <ctime>
 #include <cstdio>
 #include <stdexcept>
 #include <cmath>
@@ -13,22 +21,66 @@
 #include <cstring>
 #include <cerrno>
 #include <cstdlib>
+#include <algorithm>
 #include "Log.h"
 #include "FileSystem.h"
+#include "Defer.h"
+#include "Cgroup.h"
+#include "Watchdog.h"
 
 namespace Execute {
 static const double REALTIME_RATE = 1.5;
+//Longest gap between two looks at the CPU time of a run, in ms
+static const long long CPU_CHECK_INTERVAL = 100;
 static const double MEMORY_LIMIT_RATE = 2;
 
 uid_t NobodyUID;
 gid_t NogroupGID;
+int PoolSize = 2;
+
+static const int TRACE_OPTIONS = PTRACE_O_TRACESECCOMP | PTRACE_O_TRACESYSGOOD
+		| PTRACE_O_TRACEEXEC | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK
+		| PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL;
+
+//Control socket of a zygote, right above standard I/O
+static const int ZYGOTE_CONTROL_FD = 3;
+//Room for the seccomp program and the command line of a run handed over
+//to a zygote. Longer runs fork afresh.
+static const int ZYGOTE_MAX_FILTER = 512;
+static const int ZYGOTE_MAX_ARGS = 256;
+static const int ZYGOTE_ARG_SPACE = 16384;
+
+//A run as handed to a zygote, along with its standard I/O
+struct ZygoteCommand {
+	struct Limit limit;
+	bool inCgroup;
+	int filterLength;
+	struct sock_filter filter[ZYGOTE_MAX_FILTER];
+	char cwd[PATH_MAX];
+	int argc;
+	//The command and then argv, each NUL terminated
+	char strings[ZYGOTE_ARG_SPACE];
+};
+
+//An idle pre-forked child, stopped in recvmsg on its control socket
+struct Zygote {
+	pid_t pid;
+	int pidfd;
+	int control;
+};
 
-static bool hasExec;
+//Zygotes are traced by the thread which forked them
+static thread_local std::vector<Zygote> pool;
 
 enum executeError {
 	ERR_INVALID_SYSCALL, ERR_MLE
 };
 
+//SECCOMP_RET_DATA of the syscalls handed to the tracer
+enum traceReason {
+	TRACE_CHECK = 1, TRACE_MEMORY, TRACE_FORBIDDEN
+};
+
 static const int ALLOWED_SYSCALL[] = { SYS_getxattr, SYS_access, SYS_brk,
 		SYS_close, SYS_execve, SYS_exit_group, SYS_fstat, SYS_futex,
 		SYS_getrlimit, SYS_ioctl, SYS_ioperm, SYS_mmap, SYS_open,
@@ -45,11 +97,72 @@ static const char* ALLOWED_OPEN[] = { "/usr/", "/lib/", "/lib64/", "/etc/",
 		"/proc/" };
 static const char* ALLOWED_OPEN_LOOSE[] = { "/sys/", "/tmp/" };
 
-static const struct Arg* arg;
-static struct Result* result;
-static pid_t pid;
+static void addSyscallRule(std::vector<struct sock_filter>& filter,
+		int syscall, unsigned action) {
+	struct sock_filter rule[] = {
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (unsigned) syscall, 0, 1),
+	BPF_STMT(BPF_RET | BPF_K, action) };
+	filter.insert(filter.end(), rule, rule + 2);
+}
+
+//Compiles the allowed lists into a seccomp program.
+//Allowed syscalls go straight to the kernel, the ones whose arguments or
+//effects have to be checked stop in the tracer, anything else stops in the
+//tracer as a violation.
+static std::vector<struct sock_filter> buildFilter(const struct Limit* limit,
+		bool traceMemory) {
+	std::vector<struct sock_filter> filter;
+	struct sock_filter head[] = {
+	BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, arch)),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, AUDIT_ARCH_X86_64, 1, 0),
+	BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_KILL_PROCESS),
+	BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr)),
+	//No x32 syscalls
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 0x40000000, 0, 1),
+	BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_TRACE | TRACE_FORBIDDEN) };
+	filter.insert(filter.end(), head, head + sizeof(head) / sizeof(head[0]));
+
+	addSyscallRule(filter, SYS_open, SECCOMP_RET_TRACE | TRACE_CHECK);
+	if (limit->limitSyscall) {
+		addSyscallRule(filter, SYS_execve, SECCOMP_RET_TRACE | TRACE_CHECK);
+	}
+	if (traceMemory && limit->memoryLimit >= 0) {
+		addSyscallRule(filter, SYS_brk, SECCOMP_RET_TRACE | TRACE_MEMORY);
+		addSyscallRule(filter, SYS_mmap, SECCOMP_RET_TRACE | TRACE_MEMORY);
+		addSyscallRule(filter, SYS_munmap, SECCOMP_RET_TRACE | TRACE_MEMORY);
+	}
+	for (int callno : ALLOWED_SYSCALL) {
+		addSyscallRule(filter, callno, SECCOMP_RET_ALLOW);
+	}
+	if (!limit->limitSyscall) {
+		for (int callno : ALLOWED_SYSCALL_LOOSE) {
+			addSyscallRule(filter, callno, SECCOMP_RET_ALLOW);
+		}
+	}
+
+	struct sock_filter tail =
+	BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_TRACE | TRACE_FORBIDDEN);
+	filter.push_back(tail);
+	return filter;
+}
+
+//Limits shared by every run, set while still root
+static void setFixedRLimits() {
+	struct rlimit rlimit;
+
+	//No Core File
+	rlimit.rlim_cur = rlimit.rlim_max = 0;
+	setrlimit(RLIMIT_CORE, &rlimit);
 
-static void setRLimits(const struct Limit* limit) {
+	//NICE
+	//The real limit set is 20 - rlim_cur
+	rlimit.rlim_cur = rlimit.rlim_max = 20;
+	setrlimit(RLIMIT_NICE, &rlimit);
+}
+
+//Memory and process count are left to the cgroup when there is one.
+//Only lowers limits, so it works after dropping root as well.
+static void setRLimits(const struct Limit* limit, bool inCgroup) {
 
 	struct rlimit rlimit;
 
@@ -62,16 +175,12 @@ static void setRLimits(const struct Limit* limit) {
 
 	//Total Memory
 	//Doubled
-	if (limit->memoryLimit >= 0) {
+	if (!inCgroup && limit->memoryLimit >= 0) {
 		rlimit.rlim_cur = rlimit.rlim_max = limit->memoryLimit
 				* MEMORY_LIMIT_RATE;
 		setrlimit(RLIMIT_AS, &rlimit);
 	}
 
-	//No Core File
-	rlimit.rlim_cur = rlimit.rlim_max = 0;
-	setrlimit(RLIMIT_CORE, &rlimit);
-
 	//Execute Time
 	//To send SIGXCPU
 	if (limit->timeLimit >= 0) {
@@ -81,19 +190,36 @@ static void setRLimits(const struct Limit* limit) {
 		setrlimit(RLIMIT_CPU, &rlimit);
 	}
 
-	//NICE
-	//The real limit set is 20 - rlim_cur
-	rlimit.rlim_cur = rlimit.rlim_max = 20;
-	setrlimit(RLIMIT_NICE, &rlimit);
-
 	//Number of processes
-	if (limit->processLimit >= 0) {
+	if (!inCgroup && limit->processLimit >= 0) {
 		rlimit.rlim_cur = rlimit.rlim_max = limit->processLimit;
 		setrlimit(RLIMIT_NPROC, &rlimit);
 	}
 }
 
-static void doChild() {
+static void redirect(const char* file, int flags, int target) {
+	int fd = open(file, flags, 0700);
+	if (fd >= 0) {
+		dup2(fd, target);
+		close(fd);
+	}
+}
+
+//Runs in the forked child of a multi-threaded daemon, so it sticks to plain
+//syscalls and leaves the parent's stdio buffers alone
+void Sandbox::doChild() {
+	//Redirect standard I/O
+	//Still root here, so the blobs need not be opened up to nobody
+	redirect(arg->inputFile, O_RDONLY, STDIN_FILENO);
+	redirect(arg->outputFile, O_WRONLY | O_CREAT | O_TRUNC, STDOUT_FILENO);
+	redirect(arg->errorFile, O_WRONLY | O_CREAT | O_TRUNC, STDERR_FILENO);
+
+	//Do not leak sockets and files of other sessions
+	syscall(SYS_close_range, 3, ~0U, 0);
+
+	//Own process group, so the whole run can be killed at once
+	setpgid(0, 0);
+
 	//Set gid & uid
 	setgid(arg->gid);
 	setuid(arg->uid);
@@ -102,30 +228,129 @@ static void doChild() {
 	chdir(arg->cwd);
 
 	//Set limits
-	setRLimits(&arg->limit);
-
-	//Redirect standard I/O
-	freopen(arg->inputFile, "r", stdin);
-	freopen(arg->outputFile, "w", stdout);
-	freopen(arg->errorFile, "w", stderr);
+	setFixedRLimits();
+	setRLimits(&arg->limit, group.get() != NULL);
 
 	//Trace Me!
+	//and wait until the tracer asked for seccomp stops
 	ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+	raise(SIGSTOP);
+
+	struct sock_fprog prog;
+	prog.len = filter.size();
+	prog.filter = &filter[0];
+	if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) < 0
+			|| prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog) < 0) {
+		_exit(-1);
+	}
 
 	execvp(arg->command, arg->argv);
-	exit(-1);
+	_exit(-1);
+}
+
+//Written by a zygote only, once it is handed a run
+static struct ZygoteCommand zygoteCommand;
+
+//Body of a zygote. Whatever does not depend on the run is done up front,
+//then it sleeps traced until a run comes. Runs in the fork of a
+//multi-threaded daemon just like doChild.
+static void zygoteMain(int control, pid_t daemon) {
+	if (control != ZYGOTE_CONTROL_FD) {
+		dup2(control, ZYGOTE_CONTROL_FD);
+		close(control);
+	}
+	syscall(SYS_close_range, ZYGOTE_CONTROL_FD + 1, ~0U, 0);
+	redirect("/dev/null", O_RDWR, STDIN_FILENO);
+	redirect("/dev/null", O_RDWR, STDOUT_FILENO);
+	redirect("/dev/null", O_RDWR, STDERR_FILENO);
+
+	setpgid(0, 0);
+	setFixedRLimits();
+
+	//Idle zygotes stay root: RLIMIT_NPROC counts every process of a uid,
+	//and a pool as nobody would use up what LOOSE runs may fork
+	prctl(PR_SET_PDEATHSIG, SIGKILL);
+	if (getppid() != daemon) {
+		_exit(0);
+	}
+
+	ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+	raise(SIGSTOP);
+
+	//Standard I/O of the run comes along with the command
+	int fds[3];
+	union {
+		struct cmsghdr header;
+		char buf[CMSG_SPACE(sizeof(fds))];
+	} cmsg;
+	struct iovec iov;
+	iov.iov_base = &zygoteCommand;
+	iov.iov_len = sizeof(zygoteCommand);
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsg.buf;
+	msg.msg_controllen = sizeof(cmsg.buf);
+	if (recvmsg(ZYGOTE_CONTROL_FD, &msg, 0) != sizeof(zygoteCommand)
+			|| CMSG_FIRSTHDR(&msg) == NULL
+			|| CMSG_FIRSTHDR(&msg)->cmsg_len != CMSG_LEN(sizeof(fds))) {
+		//The daemon let go of this zygote
+		_exit(0);
+	}
+	memcpy(fds, CMSG_DATA(CMSG_FIRSTHDR(&msg)), sizeof(fds));
+	close(ZYGOTE_CONTROL_FD);
+	for (int i = 0; i < 3; i++) {
+		dup2(fds[i], i);
+	}
+	for (int i = 0; i < 3; i++) {
+		if (fds[i] > STDERR_FILENO) {
+			close(fds[i]);
+		}
+	}
+
+	setgid(NogroupGID);
+	setuid(NobodyUID);
+	//Set again after setuid, which clears it
+	prctl(PR_SET_PDEATHSIG, SIGKILL);
+	if (getppid() != daemon) {
+		_exit(0);
+	}
+
+	chdir(zygoteCommand.cwd);
+	setRLimits(&zygoteCommand.limit, zygoteCommand.inCgroup);
+
+	static char* argv[ZYGOTE_MAX_ARGS + 1];
+	char* command = zygoteCommand.strings;
+	char* next = command + strlen(command) + 1;
+	for (int i = 0; i < zygoteCommand.argc; i++) {
+		argv[i] = next;
+		next += strlen(next) + 1;
+	}
+	argv[zygoteCommand.argc] = NULL;
+
+	struct sock_fprog prog;
+	prog.len = zygoteCommand.filterLength;
+	prog.filter = zygoteCommand.filter;
+	if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) < 0
+			|| prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog) < 0) {
+		_exit(-1);
+	}
+
+	execvp(command, argv);
+	_exit(-1);
 }
 
-int getMemoryUsed(pid_t pid) {
+static long long getMemoryUsed(pid_t pid) {
 	FILE *fps;
 	char ps[32];
-	int memory;
+	long long memory;
 
 	sprintf(ps, "/proc/%d/statm", pid);
 	fps = fopen(ps, "r");
 	int i;
 	for (i = 0; i < 6; i++)
-		fscanf(fps, "%d", &memory);
+		fscanf(fps, "%lld", &memory);
 	fclose(fps);
 
 	int pagesize = getpagesize();
@@ -133,59 +358,6 @@ int getMemoryUsed(pid_t pid) {
 	return memory;
 }
 
-static bool isAllNumberic(const char* s) {
-	for (; *s; s++) {
-		if (!('0' <= *s && *s <= '9'))
-			return 0;
-	}
-	return 1;
-}
-
-static void killTree(pid_t pid) {
-	DIR* proc = opendir("/proc");
-	if (proc) {
-		struct dirent * sub;
-		while ((sub = readdir(proc)) != NULL) {
-			if (sub->d_type == DT_DIR && isAllNumberic(sub->d_name)) {
-				char statName[100];
-				strcpy(statName, "/proc/");
-				strcat(statName, sub->d_name);
-				strcat(statName, "/stat");
-				FILE* statFile = fopen(statName, "r");
-				if (statFile) {
-					int ppid;
-					fscanf(statFile, "%*s%*s%*s%d", &ppid);
-					fclose(statFile);
-					if (ppid == pid) {
-						killTree(atoi(sub->d_name));
-					}
-				}
-			}
-		}
-		closedir(proc);
-	}
-	kill(pid, SIGKILL);
-}
-
-static bool isSyscallAllowed(int syscall) {
-	for (int callno : ALLOWED_SYSCALL) {
-		if (callno == syscall) {
-			return true;
-		}
-	}
-	return false;
-}
-
-static bool isLooseSyscallAllowed(int syscall) {
-	for (int callno : ALLOWED_SYSCALL_LOOSE) {
-		if (callno == syscall) {
-			return true;
-		}
-	}
-	//ERR("Forbi: %d", syscall);
-	return false;
-}
-
 static std::string peekString(pid_t pid, char*addr) {
 	union {
 		long l;
@@ -234,26 +406,14 @@ static bool checkLooseOpen(std::string path) {
 	return false;
 }
 
-static bool checkSyscall(pid_t pid) {
+//Called on the seccomp stop of a syscall the filter did not let through
+bool Sandbox::checkSyscall(pid_t who, unsigned long reason) {
 	struct user_regs_struct regs;
-	ptrace(PTRACE_GETREGS, pid, NULL, &regs);
+	ptrace(PTRACE_GETREGS, who, NULL, &regs);
 
 	long syscall = regs.orig_rax;
-	/*
-	 printf("Syscall(Ret=%ld): %ld (%ld,%ld,%ld)\n", regs.rax, syscall, regs.rdi,
-	 regs.rsi, regs.rdx);
-	 if (syscall == SYS_access) {
-	 char buf[100];
-	 puts(peekString(pid, buf, 100, (char*) regs.rdi));
-	 } else if (syscall == SYS_write) {
-	 char buf[100];
-	 puts(peekString(pid, buf, 100, (char*) regs.rsi));
-	 }
-	 */
-
-	if (arg->limit.limitSyscall && !isSyscallAllowed(syscall)
-			|| !arg->limit.limitSyscall && !isSyscallAllowed(syscall)
-					&& !isLooseSyscallAllowed(syscall)) {
+
+	if (reason == TRACE_FORBIDDEN) {
 		ERR("Caught forbidden syscall %ld", syscall);
 		errno = ERR_INVALID_SYSCALL;
 		return 0;
@@ -262,10 +422,10 @@ static bool checkSyscall(pid_t pid) {
 	std::string openingFile;
 	switch (syscall) {
 	case SYS_open:
-		openingFile = peekString(pid, (char*) regs.rdi);
-		if (arg->limit.limitSyscall && !checkOpen(openingFile)
-				|| !arg->limit.limitSyscall && !checkOpen(openingFile)
-						&& !checkLooseOpen(openingFile)) {
+		openingFile = peekString(who, (char*) regs.rdi);
+		if ((arg->limit.limitSyscall && !checkOpen(openingFile))
+				|| (!arg->limit.limitSyscall && !checkOpen(openingFile)
+						&& !checkLooseOpen(openingFile))) {
 			ERR("Caught opening forbidden file %s", openingFile.c_str());
 			errno = ERR_INVALID_SYSCALL;
 			return false;
@@ -279,141 +439,532 @@ static bool checkSyscall(pid_t pid) {
 		}
 		hasExec = true;
 		break;
-	case SYS_brk:
-	case SYS_mmap:
-	case SYS_munmap:
-		result->memory = getMemoryUsed(pid);
-		if (arg->limit.memoryLimit >= 0
-				&& result->memory > arg->limit.memoryLimit) {
-			errno = ERR_MLE;
-			return 0;
-		}
-		break;
 	}
 
 	return 1;
 }
 
-static void alarmHandler(int signo) {
-	kill(pid, SIGUSR1);
-	alarm(1);
+//Called when brk, mmap or munmap returns
+bool Sandbox::checkMemory(pid_t who) {
+	result->memory = std::max(result->memory, getMemoryUsed(who));
+	if (arg->limit.memoryLimit >= 0 && result->memory > arg->limit.memoryLimit) {
+		errno = ERR_MLE;
+		return 0;
+	}
+	return 1;
 }
 
-static void parentLoop(pid_t pid) {
-	for (;;) {
-		struct rusage rusage;
-		int status;
+static int pidfdOpen(pid_t pid) {
+	return syscall(SYS_pidfd_open, pid, 0);
+}
+
+static int pidfdSendSignal(int pidfd, int signo) {
+	return syscall(SYS_pidfd_send_signal, pidfd, signo, NULL, 0);
+}
 
-		//Wait for my child
-		wait4(pid, &status, 0, &rusage);
+static void discardZygote(const Zygote& zygote) {
+	kill(zygote.pid, SIGKILL);
+	waitpid(zygote.pid, NULL, __WALL);
+	close(zygote.pidfd);
+	close(zygote.control);
+}
 
-		if (result->type != UNKNOWN) {
-			assert(WIFEXITED(status) || WIFSIGNALED(status));
+static bool forkZygote(Zygote& zygote) {
+	int control[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, control) < 0) {
+		return false;
+	}
+	pid_t daemon = getpid();
+	pid_t pid = fork();
+	if (pid < 0) {
+		close(control[0]);
+		close(control[1]);
+		return false;
+	}
+	if (pid == 0) {
+		zygoteMain(control[1], daemon);
+	}
+	close(control[1]);
+	zygote.pid = pid;
+	zygote.control = control[0];
+	zygote.pidfd = -1;
+
+	//Stopped right after PTRACE_TRACEME; it goes on into recvmsg
+	int status;
+	if (waitpid(pid, &status, __WALL) < 0 || !WIFSTOPPED(status)
+			|| ptrace(PTRACE_SETOPTIONS, pid, NULL, TRACE_OPTIONS) < 0
+			|| ptrace(PTRACE_CONT, pid, NULL, NULL) < 0
+			|| (zygote.pidfd = pidfdOpen(pid)) < 0) {
+		discardZygote(zygote);
+		return false;
+	}
+	return true;
+}
+
+void FillPool() {
+	while ((int) pool.size() < PoolSize) {
+		Zygote zygote;
+		if (!forkZygote(zygote)) {
+			ERR("Cannot fork a zygote");
 			return;
 		}
+		pool.push_back(zygote);
+	}
+}
+
+//Hands the run over to an idle zygote of this thread.
+//False when there is none to take it, the run has to fork then.
+bool Sandbox::startWarm() {
+	if (pool.empty() || arg->uid != NobodyUID || arg->gid != NogroupGID
+			|| filter.size() > (size_t) ZYGOTE_MAX_FILTER
+			|| strlen(arg->cwd) >= PATH_MAX) {
+		return false;
+	}
+
+	static thread_local struct ZygoteCommand command;
+	command.limit = arg->limit;
+	command.inCgroup = group.get() != NULL;
+	command.filterLength = filter.size();
+	std::copy(filter.begin(), filter.end(), command.filter);
+	strcpy(command.cwd, arg->cwd);
+	size_t used = strlen(arg->command) + 1;
+	if (used > sizeof(command.strings)) {
+		return false;
+	}
+	strcpy(command.strings, arg->command);
+	command.argc = 0;
+	for (char* const* argv = arg->argv; *argv != NULL; argv++) {
+		size_t len = strlen(*argv) + 1;
+		if (command.argc == ZYGOTE_MAX_ARGS
+				|| used + len > sizeof(command.strings)) {
+			return false;
+		}
+		memcpy(command.strings + used, *argv, len);
+		used += len;
+		command.argc++;
+	}
+
+	//Opened here as root, so the blobs need not be opened up to nobody
+	int fds[3];
+	fds[0] = open(arg->inputFile, O_RDONLY | O_CLOEXEC);
+	fds[1] = open(arg->outputFile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+			0700);
+	fds[2] = open(arg->errorFile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+			0700);
+	Defer fdsCloser([&]() {
+		for (int fd : fds) {
+			if (fd >= 0) {
+				close(fd);
+			}
+		}
+	});
+	for (int fd : fds) {
+		if (fd < 0) {
+			return false;
+		}
+	}
 
-		result->time = rusage.ru_utime.tv_sec * 1000
-				+ rusage.ru_utime.tv_usec / 1000;
+	union {
+		struct cmsghdr header;
+		char buf[CMSG_SPACE(sizeof(fds))];
+	} cmsg;
+	memset(&cmsg, 0, sizeof(cmsg));
+	struct iovec iov;
+	iov.iov_base = &command;
+	iov.iov_len = sizeof(command);
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsg.buf;
+	msg.msg_controllen = sizeof(cmsg.buf);
+	struct cmsghdr* header = CMSG_FIRSTHDR(&msg);
+	header->cmsg_level = SOL_SOCKET;
+	header->cmsg_type = SCM_RIGHTS;
+	header->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(header), fds, sizeof(fds));
+
+	while (!pool.empty()) {
+		Zygote zygote = pool.back();
+		pool.pop_back();
+		if (group) {
+			try {
+				group->Attach(zygote.pid);
+			} catch (std::runtime_error& e) {
+				discardZygote(zygote);
+				throw;
+			}
+		}
+		if (sendmsg(zygote.control, &msg, MSG_NOSIGNAL) == sizeof(command)) {
+			close(zygote.control);
+			pid = zygote.pid;
+			pidfd = zygote.pidfd;
+			return true;
+		}
+		//Died while waiting
+		discardZygote(zygote);
+	}
+	return false;
+}
 
-		if (arg->limit.timeLimit >= 0 && result->time > arg->limit.timeLimit) {
-			result->type = TLE;
-			killTree(pid);
+//Kills the program and everything it forked
+void Sandbox::terminate() {
+	if (group) {
+		group->Kill();
+		return;
+	}
+	//setpgid and setsid are not allowed in the sandbox, so whatever the
+	//program forked stays in its process group. Once the main process is
+	//reaped its pid may name an unrelated group, but every process left
+	//is a tracee we know about.
+	if (!mainExited) {
+		kill(-pid, SIGKILL);
+	} else {
+		for (pid_t tracee : tracees) {
+			kill(tracee, SIGKILL);
 		}
+	}
+}
 
-		if (WIFEXITED(status)) {
-			int exitStatus = WEXITSTATUS(status);
-			result->exitStatus = exitStatus;
-			if (exitStatus == 0) {
-				result->type = SUCCESS;
-			} else {
-				result->type = FAILURE;
+//User and system time, in us
+long long Sandbox::cpuTime(const struct rusage& rusage) {
+	if (group) {
+		return group->CpuTime();
+	}
+	return (rusage.ru_utime.tv_sec + rusage.ru_stime.tv_sec) * 1000000LL
+			+ rusage.ru_utime.tv_usec + rusage.ru_stime.tv_usec;
+}
+
+//Takes over a child forked for this run alone
+bool Sandbox::attachCold() {
+	//The first stop is the SIGSTOP raised by the child right after
+	//PTRACE_TRACEME, nothing of the program has run yet
+	int status;
+	if (waitpid(pid, &status, __WALL) < 0 || !WIFSTOPPED(status)) {
+		ERR("Child did not stop for the tracer");
+		result->type = CRASHED;
+		terminate();
+		waitpid(pid, &status, __WALL);
+		return false;
+	}
+	if (group) {
+		try {
+			group->Attach(pid);
+		} catch (std::runtime_error& e) {
+			kill(pid, SIGKILL);
+			waitpid(pid, &status, __WALL);
+			throw;
+		}
+	}
+	ptrace(PTRACE_SETOPTIONS, pid, NULL, TRACE_OPTIONS);
+	ptrace(PTRACE_CONT, pid, NULL, NULL);
+	return true;
+}
+
+void Sandbox::parentLoop() {
+	int status;
+	for (;;) {
+		struct rusage rusage;
+
+		//Wait for my child or anything it forked, which all stay in its
+		//process group. This keeps the idle zygotes of this thread out, and
+		//__WNOTHREAD keeps other sessions' tracees out.
+		pid_t who = wait4(-pid, &status, __WALL | __WNOTHREAD, &rusage);
+		if (who < 0) {
+			if (errno == EINTR) {
+				continue;
 			}
+			//No tracee left
 			return;
-		} else if (WIFSIGNALED(status)) {
-			//assert(WTERMSIG(status)==SIGKILL);
-			result->type = CRASHED;
-			result->exitStatus = WTERMSIG(status);
-			return;
-		} else if (WIFSTOPPED(status)) {
-			int signo = WSTOPSIG(status);
+		}
+
+		if (WIFEXITED(status) || WIFSIGNALED(status)) {
+			if (who != pid) {
+				tracees.erase(who);
+				continue;
+			}
+			mainExited = true;
+			result->time = cpuTime(rusage);
+			//Nothing forked may outlive the run
+			terminate();
+			if (result->type != UNKNOWN) {
+				continue;
+			}
+			if (timeExceeded
+					|| (arg->limit.timeLimit >= 0
+							&& result->time > arg->limit.timeLimit * 1000LL)) {
+				result->type = TLE;
+			} else if (WIFEXITED(status)) {
+				int exitStatus = WEXITSTATUS(status);
+				result->exitStatus = exitStatus;
+				if (exitStatus == 0) {
+					result->type = SUCCESS;
+				} else {
+					result->type = FAILURE;
+				}
+			} else {
+				//assert(WTERMSIG(status)==SIGKILL);
+				result->type = CRASHED;
+				result->exitStatus = WTERMSIG(status);
+			}
+			continue;
+		}
+
+		if (!WIFSTOPPED(status)) {
+			ERR("Not End or Stop!");
+			terminate();
+			continue;
+		}
+
+		if (who != pid) {
+			tracees.insert(who);
+		} else {
+			result->time = cpuTime(rusage);
+			if (result->type == UNKNOWN && arg->limit.timeLimit >= 0
+					&& result->time > arg->limit.timeLimit * 1000LL) {
+				result->type = TLE;
+				terminate();
+			}
+		}
+
+		if (mainExited || result->type != UNKNOWN) {
+			//Being killed, let it go
+			//Also catches a child forked right before the kill
+			kill(who, SIGKILL);
+			ptrace(PTRACE_CONT, who, NULL, NULL);
+			continue;
+		}
+
+		enum __ptrace_request resume = PTRACE_CONT;
+		int signo = WSTOPSIG(status);
+		int event = status >> 16;
+		if (signo == SIGTRAP && event == PTRACE_EVENT_SECCOMP) {
+			unsigned long reason;
+			ptrace(PTRACE_GETEVENTMSG, who, NULL, &reason);
+			if (reason == TRACE_MEMORY) {
+				//Measure when the syscall returns
+				resume = PTRACE_SYSCALL;
+			} else if (!checkSyscall(who, reason)) {
+				result->type = VIOLATION;
+				terminate();
+			}
+		} else if (signo == SIGTRAP && event != 0) {
+			//fork, vfork, clone or exec event
+		} else if (signo == (SIGTRAP | 0x80)) {
+			struct __ptrace_syscall_info info;
+			if (ptrace(PTRACE_GET_SYSCALL_INFO, who, sizeof(info), &info) > 0
+					&& info.op != PTRACE_SYSCALL_INFO_EXIT) {
+				resume = PTRACE_SYSCALL;
+			} else if (!checkMemory(who)) {
+				result->type = MLE;
+				terminate();
+			}
+		} else {
 			switch (signo) {
+			case SIGSTOP:
 			case SIGURG:
 			case SIGCHLD:
 			case SIGWINCH:
 				//Ignore
 				break;
-			case SIGTRAP:
-				//He invoked a syscall
-				if (!checkSyscall(pid)) {
-					switch (errno) {
-					case ERR_INVALID_SYSCALL:
-						result->type = VIOLATION;
-						break;
-					case ERR_MLE:
-						result->type = MLE;
-						break;
-					}
-					killTree(pid);
-				}
-				break;
 			case SIGXFSZ:
 				result->type = OLE;
-				killTree(pid);
+				terminate();
 				break;
 			case SIGXCPU:
 				result->type = TLE;
-				killTree(pid);
-				break;
-			case SIGUSR1:
-				//Real time too long
-				result->type = TLE;
-				killTree(pid);
+				terminate();
 				break;
 			case SIGSEGV:
 				result->type = MEM_VIOLATION;
-				killTree(pid);
+				terminate();
 				break;
 			case SIGFPE:
 				result->type = MATH_ERROR;
-				killTree(pid);
+				terminate();
 				break;
 			default:
 				result->type = CRASHED;
-				killTree(pid);
+				terminate();
 				break;
 			}
-		} else {
-			ERR("Not End or Stop!");
-			killTree(pid);
 		}
 
-		ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+		ptrace(resume, who, NULL, NULL);
+	}
+}
+
+Cancel::Cancel() :
+		pidfd(-1), stopped(false) {
+	pthread_mutex_init(&lock, NULL);
+}
+
+Cancel::~Cancel() {
+	pthread_mutex_destroy(&lock);
+}
+
+void Cancel::Stop() {
+	pthread_mutex_lock(&lock);
+	stopped = true;
+	if (pidfd >= 0) {
+		pidfdSendSignal(pidfd, SIGKILL);
 	}
+	pthread_mutex_unlock(&lock);
+}
+
+bool Cancel::Attach(int _pidfd) {
+	pthread_mutex_lock(&lock);
+	pidfd = _pidfd;
+	bool run = !stopped;
+	pthread_mutex_unlock(&lock);
+	return run;
+}
+
+//Before the pidfd is closed, so that its number is never signalled again
+void Cancel::Detach() {
+	pthread_mutex_lock(&lock);
+	pidfd = -1;
+	pthread_mutex_unlock(&lock);
 }
 
-void Execute(const struct Arg* _arg, struct Result* _result) {
-	arg = _arg;
-	result = _result;
+Sandbox::Sandbox(const struct Arg* _arg, struct Result* _result) :
+		arg(_arg), result(_result), pid(-1), pidfd(-1), hasExec(false), mainExited(
+				false), timeExceeded(false) {
+}
 
+//Real Time Alarm to prevent infinite sleep
+//Runs on the watchdog thread. SIGKILL through the pidfd cannot be blocked
+//by the program and never hits a recycled pid; the tracer finds the flag
+//when it reaps the main process.
+long long Sandbox::realTimeLimitExceeded() {
+	timeExceeded = true;
+	pidfdSendSignal(pidfd, SIGKILL);
+	return -1;
+}
+
+//Runs on the watchdog thread as well.
+//RLIMIT_CPU only counts whole seconds and is merely checked at the next
+//stop of a program making no syscalls, so the CPU time is looked at
+//directly, next when the limit could be reached at the earliest. A single
+//thread cannot burn CPU faster than the clock runs; more threads are
+//caught by the interval.
+long long Sandbox::checkCpuTime() {
+	long long used;
+	if (group) {
+		used = group->CpuTime();
+	} else {
+		clockid_t clock;
+		struct timespec ts;
+		if (clock_getcpuclockid(pid, &clock) != 0
+				|| clock_gettime(clock, &ts) != 0) {
+			return -1;
+		}
+		used = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+	}
+
+	long long left = arg->limit.timeLimit * 1000LL - used;
+	if (left < 0) {
+		timeExceeded = true;
+		pidfdSendSignal(pidfd, SIGKILL);
+		return -1;
+	}
+	return std::min(CPU_CHECK_INTERVAL, left / 1000 + 1);
+}
+
+void Sandbox::Run() {
 	memset(result, 0, sizeof(struct Result));
 	result->type = UNKNOWN;
 	hasExec = false;
+	timeExceeded = false;
+	mainExited = false;
+	tracees.clear();
+
+	if (Cgroup::Available) {
+		group.reset(new Cgroup::Group());
+		if (arg->limit.memoryLimit >= 0) {
+			group->SetMemoryLimit(arg->limit.memoryLimit);
+		}
+		if (arg->limit.processLimit >= 0) {
+			group->SetProcessLimit(arg->limit.processLimit);
+		}
+	}
+	Defer groupRemover([=]() {
+		group.reset();
+	});
+	filter = buildFilter(&arg->limit, !group);
+
+	bool warm = startWarm();
+	if (!warm) {
+		pid = fork();
+		if (pid < 0) {
+			throw std::runtime_error("Cannot fork");
+		}
+		if (pid == 0) {
+			doChild();
+		}
 
-	pid = fork();
-	if (pid == 0) {
-		doChild();
-	} else {
-		//Real Time Alarm to prevent infinite sleep
-		if (arg->limit.timeLimit >= 0) {
-			signal(SIGALRM, alarmHandler);
-			alarm(ceil(REALTIME_RATE * arg->limit.timeLimit / 1000.0));
+		pidfd = pidfdOpen(pid);
+		if (pidfd < 0) {
+			kill(pid, SIGKILL);
+			waitpid(pid, NULL, 0);
+			throw std::runtime_error("Cannot open pidfd");
+		}
+	}
+	Defer pidfdCloser([=]() {
+		close(pidfd);
+	});
+	if (!warm && !attachCold()) {
+		return;
+	}
+	if (arg->cancel != NULL && !arg->cancel->Attach(pidfd)) {
+		//Reaped by the loop below like any other kill
+		pidfdSendSignal(pidfd, SIGKILL);
+	}
+	Defer detacher([=]() {
+		if (arg->cancel != NULL) {
+			arg->cancel->Detach();
+		}
+	});
+
+	int realTimeWatch = -1, cpuTimeWatch = -1;
+	if (arg->limit.timeLimit >= 0) {
+		try {
+			realTimeWatch = Watchdog::Watch(pidfd,
+					ceil(REALTIME_RATE * arg->limit.timeLimit),
+					[=]() {return realTimeLimitExceeded();});
+			cpuTimeWatch = Watchdog::Watch(pidfd, arg->limit.timeLimit,
+					[=]() {return checkCpuTime();});
+		} catch (std::runtime_error& e) {
+			ERR("%s, time is limited by rlimit only", e.what());
+		}
+	}
+	Defer unwatch([=]() {
+		if (realTimeWatch >= 0) {
+			Watchdog::Unwatch(realTimeWatch);
+		}
+		if (cpuTimeWatch >= 0) {
+			Watchdog::Unwatch(cpuTimeWatch);
+		}
+	});
+
+	parentLoop();
+
+	if (group) {
+		result->memory = group->MemoryPeak();
+		if (group->OomKilled() && result->type == CRASHED) {
+			result->type = MLE;
 		}
-		parentLoop(pid);
-		alarm(0);
 	}
 }
 
+void Execute(const struct Arg* arg, struct Result* result) {
+	Sandbox(arg, result).Run();
+}
+
 void Init() {
+	Cgroup::Init();
+	Watchdog::Init();
+
 	struct passwd *nobody = getpwnam("nobody");
 	if (nobody == NULL) {
 		throw std::runtime_error("Cannot find 'nobody'.");
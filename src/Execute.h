@@ -1,7 +1,16 @@
 #pragma once
 #include <unistd.h>
+#include <cstdint>
 #include <pwd.h>
 #include <grp.h>
+#include <linux/filter.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <atomic>
+#include <memory>
+#include <set>
+#include <vector>
+#include "Cgroup.h"
 namespace Execute{
 struct Limit{
 	//In bytes
@@ -17,6 +26,23 @@ struct Limit{
 	bool limitSyscall;
 };
 
+//Lets another thread stop one run, whether it started already or not
+class Cancel{
+	Cancel(const Cancel&);
+	Cancel& operator=(const Cancel&);
+	pthread_mutex_t lock;
+	int pidfd;
+	bool stopped;
+public:
+	Cancel();
+	~Cancel();
+	void Stop();
+	//Called by the sandbox while it holds the run's pidfd. Attach returns
+	//false when the run is to be stopped right away.
+	bool Attach(int pidfd);
+	void Detach();
+};
+
 struct Arg{
 	const char* command;
 	char* const* argv;
@@ -25,9 +51,11 @@ struct Arg{
 	uid_t uid;
 	gid_t gid;
 	struct Limit limit;
+	//NULL when the run is never stopped early
+	Cancel* cancel;
 };
 
-enum ResultType{
+enum ResultType : int32_t{
 	UNKNOWN=-1,
 	SUCCESS,
 	FAILURE,
@@ -40,16 +68,63 @@ enum ResultType{
 	MEM_VIOLATION,
 };
 
+inline bool ValidEnum(ResultType type){
+	return type >= UNKNOWN && type <= MEM_VIOLATION;
+}
+
 struct Result{
 	enum ResultType type;
 	int exitStatus;
-	int time;
+	//User and system time, in us
+	long long time;
 	long long memory;
 };
 
 extern uid_t NobodyUID;
 extern gid_t NogroupGID;
 
+//Idle children every running thread keeps forked and traced, so that a run
+//costs little more than its execve. They drop to nobody once handed a run,
+//to stay out of its process limit until then. 0 disables it.
+extern int PoolSize;
+
+//One traced run of a program.
+//All the state of a run lives here, so any number of sandboxes may run at
+//the same time from different threads. Run() must be called from the thread
+//which is going to wait for the tracee, as ptrace binds it to that thread.
+class Sandbox{
+	const struct Arg* arg;
+	struct Result* result;
+	pid_t pid;
+	int pidfd;
+	bool hasExec;
+	std::vector<struct sock_filter> filter;
+	bool mainExited;
+	//Everything forked by the program
+	std::set<pid_t> tracees;
+	//NULL when cgroup v2 is not available
+	std::unique_ptr<Cgroup::Group> group;
+
+	//Set by the watchdog thread
+	std::atomic<bool> timeExceeded;
+
+	long long realTimeLimitExceeded();
+	long long checkCpuTime();
+	void doChild();
+	bool startWarm();
+	bool attachCold();
+	bool checkSyscall(pid_t who, unsigned long reason);
+	bool checkMemory(pid_t who);
+	void terminate();
+	long long cpuTime(const struct rusage& rusage);
+	void parentLoop();
+public:
+	Sandbox(const struct Arg* arg,struct Result* result);
+	void Run();
+};
+
 extern void Execute(const struct Arg* arg,struct Result* result);
+//Tops up the pool of the calling thread, which alone may use it
+extern void FillPool();
 extern void Init();
 }
@@ -4,6 +4,10 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/statvfs.h>
+#include <linux/fs.h>
 #include <dirent.h>
 #include <cstdio>
 #include <cstdlib>
@@ -16,36 +20,222 @@
 #include <stdexcept>
 #include <sstream>
 #include <algorithm>
+#include <unordered_set>
 #include <pthread.h>
 #include "Log.h"
 #include "Defer.h"
+#include "Hash.h"
+#include "BlobIndex.h"
 
 namespace FileSystem {
 static const int RANDSTR_LEN = 10;
 static const double MIN_DELETION_TIME = 10 * 60;
 static const int CLEAN_INTERVAL = 60;
 static const off_t MAX_CACHE_SIZE = 500 * 1024 * 1024;
+//Memory used per streamed transfer
+static const size_t STREAM_BUFFER_SIZE = 64 * 1024;
 
 std::string Root;
+bool ContentAddressed = false;
+long long WorkspaceSize = 0;
+
+//Directories of the daemon itself start with a dot, which names cannot
+static const char* OBJECTS_DIR = ".objects/";
+static const char* COMPILE_DIR = ".compile/";
+static const char* MANIFEST = ".manifest";
+static const char* TRASH_DIR = ".trash/";
+
+//Whether path names a blob, and which
+static bool blobName(const std::string& path, std::string& name) {
+	if (Root.empty() || path.compare(0, Root.size(), Root) != 0
+			|| path.size() == Root.size()
+			|| path.find('/', Root.size()) != std::string::npos) {
+		return false;
+	}
+	name = path.substr(Root.size());
+	return true;
+}
+
+//The object is cached content only once no name links to it any more
+static void releaseObject(const std::string& object) {
+	struct stat sts;
+	if (object.empty() || stat((Root + object).c_str(), &sts) < 0
+			|| sts.st_nlink > 1) {
+		return;
+	}
+	BlobIndex::Blob blob;
+	blob.name = object;
+	blob.size = sts.st_size;
+	blob.lastUse = time(NULL);
+	BlobIndex::Put(blob);
+}
+
+static void indexPut(const BlobIndex::Blob& blob) {
+	std::string old = BlobIndex::Put(blob);
+	if (old != blob.object) {
+		releaseObject(old);
+	}
+	if (BlobIndex::CacheSize() > MAX_CACHE_SIZE) {
+		CleanBlobs();
+	}
+}
+
+//Indexes the blob at path as it is on disk now, keeping its object
+static void indexFile(const std::string& path, const std::string& object) {
+	std::string name;
+	struct stat sts;
+	if (!blobName(path, name) || stat(path.c_str(), &sts) < 0) {
+		return;
+	}
+	BlobIndex::Blob blob;
+	blob.name = name;
+	blob.size = sts.st_size;
+	blob.lastUse = time(NULL);
+	blob.object = object;
+	indexPut(blob);
+}
+
+static void indexRemove(const std::string& path) {
+	std::string name;
+	if (blobName(path, name)) {
+		releaseObject(BlobIndex::Remove(name));
+	}
+}
+
+static BlobIndex::Blob indexUse(const std::string& path) {
+	std::string name;
+	BlobIndex::Blob blob;
+	if (!blobName(path, name) || !BlobIndex::Use(name, &blob)) {
+		blob.name = name;
+	}
+	return blob;
+}
+
+//The regular files of dir with their last use, oldest first
+static std::vector<BlobIndex::Blob> scanDirectory(std::string dir,
+		std::string prefix, bool unlinkedOnly) {
+	DIR* dirp = opendir((Root + prefix).c_str());
+	if (dirp == NULL) {
+		throw std::runtime_error("Cannot open " + dir);
+	}
+	Defer dirCloser([=]() {
+		closedir(dirp);
+	});
+
+	std::vector<BlobIndex::Blob> blobs;
+	struct dirent* file;
+	while ((file = readdir(dirp)) != NULL) {
+		//Dot files are the daemon's own
+		if (file->d_type != DT_REG || file->d_name[0] == '.') {
+			continue;
+		}
+		struct stat sts;
+		std::string name = prefix + file->d_name;
+		if (stat((Root + name).c_str(), &sts) < 0
+				|| (unlinkedOnly && sts.st_nlink > 1)) {
+			continue;
+		}
+		BlobIndex::Blob blob;
+		blob.name = name;
+		blob.size = sts.st_size;
+		blob.lastUse = std::max(sts.st_atime,
+				std::max(sts.st_ctime, sts.st_mtime));
+		blobs.push_back(blob);
+	}
+	std::sort(blobs.begin(), blobs.end(),
+			[](const BlobIndex::Blob& a, const BlobIndex::Blob& b) {
+				return a.lastUse < b.lastUse;
+			});
+	return blobs;
+}
+
+static std::vector<BlobIndex::Blob> scanBlobs() {
+	std::vector<BlobIndex::Blob> blobs = scanDirectory("blob directory", "",
+			false);
+	std::vector<BlobIndex::Blob> compiled = scanDirectory("compile cache",
+			COMPILE_DIR, false);
+	blobs.insert(blobs.end(), compiled.begin(), compiled.end());
+	if (ContentAddressed) {
+		std::vector<BlobIndex::Blob> objects = scanDirectory(
+				"object directory", OBJECTS_DIR, true);
+		blobs.insert(blobs.end(), objects.begin(), objects.end());
+	}
+	return blobs;
+}
+
+//Whether the manifest was read, and is to be checked against the disk
+static bool manifestLoaded = false;
+
+//Reads back the blobs which survived the last run, from the manifest if
+//there is one, which is quick, or else by scanning Root once
+static void loadIndex() {
+	if (BlobIndex::Open(Root + MANIFEST)) {
+		manifestLoaded = true;
+		LOG("Blob index read from %s%s", Root.c_str(), MANIFEST);
+		return;
+	}
+	std::vector<BlobIndex::Blob> blobs = scanBlobs();
+	for (const BlobIndex::Blob& blob : blobs) {
+		BlobIndex::Put(blob);
+	}
+	BlobIndex::Save();
+	LOG("Indexed %d files in %s", (int) blobs.size(), Root.c_str());
+}
+
+//The manifest misses what happened after its last append if the daemon
+//died right then, and whatever was changed by hand while it was down
+static void reconcile() {
+	std::unordered_set<std::string> known;
+	for (const BlobIndex::Blob& blob : BlobIndex::List()) {
+		known.insert(blob.name);
+	}
+	std::vector<BlobIndex::Blob> found = scanBlobs();
+
+	int added = 0, removed = 0;
+	//Newest first, as each one goes behind the others
+	for (auto it = found.rbegin(); it != found.rend(); ++it) {
+		if (known.erase(it->name) == 0 && BlobIndex::Add(*it)) {
+			added++;
+		}
+	}
+	for (const std::string& name : known) {
+		if (access((Root + name).c_str(), F_OK) < 0 && errno == ENOENT) {
+			releaseObject(BlobIndex::Remove(name));
+			removed++;
+		}
+	}
+	if (added > 0 || removed > 0) {
+		LOG("Blob manifest was missing %d blobs and had %d gone", added,
+				removed);
+	}
+}
 
 static void* cleanThread(void*) {
+	//Only Init moves anything in, before sessions start
+	RecursiveRemove(Root + TRASH_DIR);
+	if (manifestLoaded) {
+		try {
+			reconcile();
+		} catch (std::runtime_error& err) {
+			ERR("%s", err.what());
+		}
+	}
 	for (;;) {
 		try {
 			CleanBlobs();
 		} catch (std::runtime_error& err) {
 			ERR("%s", err.what());
 		}
+		BlobIndex::Save();
 		sleep(CLEAN_INTERVAL);
 	}
 	return NULL;
 }
-
 void Init() {
 	srand(time(NULL));
 
 	const char* cacheDir = "/var/cache/allkorrect/";
 	if (HasBlob(cacheDir)) {
-		RemoveSubDirs(cacheDir);
 		LOG("Use cache directory at %s", cacheDir);
 	} else {
 		if (mkdir(cacheDir, 0711) < 0) {
@@ -56,6 +246,29 @@ void Init() {
 
 	Root = cacheDir;
 
+	//Leftover workspaces have to be gone before sessions are handed
+	//names of the same kind, only deleting them is left to the clean thread
+	std::string trash = Root + TRASH_DIR;
+	if (mkdir(trash.c_str(), 0700) < 0 && errno != EEXIST) {
+		throw std::runtime_error("Cannot create trash directory");
+	}
+	RemoveSubDirs(Root, trash);
+
+	if (ContentAddressed) {
+		std::string objects = Root + OBJECTS_DIR;
+		if (mkdir(objects.c_str(), 0700) < 0 && errno != EEXIST) {
+			throw std::runtime_error("Cannot create object directory");
+		}
+		LOG("Content addressed blobs at %s", objects.c_str());
+	}
+
+	std::string compiled = Root + COMPILE_DIR;
+	if (mkdir(compiled.c_str(), 0700) < 0 && errno != EEXIST) {
+		throw std::runtime_error("Cannot create compile cache");
+	}
+
+	loadIndex();
+
 	pthread_t pid;
 	pthread_create(&pid, NULL, cleanThread, NULL);
 }
@@ -98,7 +311,7 @@ void RecursiveRemove(std::string dirname) {
 	rmdir(dirname.c_str());
 }
 
-void RemoveSubDirs(std::string dirname) {
+void RemoveSubDirs(std::string dirname, std::string trash) {
 	DIR *dir;
 	struct dirent *entry;
 	dir = opendir(dirname.c_str());
@@ -108,9 +321,14 @@ void RemoveSubDirs(std::string dirname) {
 
 	while ((entry = readdir(dir)) != NULL) {
 		if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, "..")) {
-			std::string path = dirname + entry->d_name;
-			if (entry->d_type == DT_DIR) {
-				RecursiveRemove(path);
+			if (entry->d_type == DT_DIR && entry->d_name[0] != '.') {
+				//Workspace of a daemon which did not stop cleanly
+				std::string path = dirname + entry->d_name;
+				umount2(path.c_str(), MNT_DETACH);
+				if (rename(path.c_str(), (trash + entry->d_name).c_str())
+						< 0) {
+					RecursiveRemove(path);
+				}
 			}
 		}
 
@@ -124,15 +342,52 @@ std::string NewTmpDir() {
 		throw std::runtime_error("Cannot create tmp dir");
 	}
 	chmod(tmpDir.c_str(), 0733);
+
+	if (WorkspaceSize > 0) {
+		char options[64];
+		snprintf(options, sizeof(options), "size=%lld,mode=0733",
+				WorkspaceSize);
+		if (mount("tmpfs", tmpDir.c_str(), "tmpfs",
+				MS_NOSUID | MS_NODEV | MS_NOATIME, options) < 0) {
+			rmdir(tmpDir.c_str());
+			throw std::runtime_error("Cannot mount workspace");
+		}
+	}
 	return tmpDir;
 }
 
+void RemoveTmpDir(std::string tmpDir) {
+	if (WorkspaceSize > 0) {
+		//Drops every file at once, even if something still holds one open
+		umount2(tmpDir.c_str(), MNT_DETACH);
+		rmdir(tmpDir.c_str());
+		return;
+	}
+	RecursiveRemove(tmpDir);
+}
+
+bool WorkspaceFull(std::string tmpDir) {
+	struct statvfs stats;
+	return WorkspaceSize > 0 && statvfs(tmpDir.c_str(), &stats) == 0
+			&& stats.f_bavail == 0;
+}
+
 void NewBlob(std::string path) {
 	int fd = open(path.c_str(), O_CREAT, 0700);
 	if (fd < 0) {
 		throw std::runtime_error("Cannot create blob");
 	}
 	close(fd);
+	indexFile(path, "");
+}
+
+void RefreshBlob(std::string path) {
+	indexFile(path, indexUse(path).object);
+}
+
+void RemoveBlob(std::string path) {
+	unlink(path.c_str());
+	indexRemove(path);
 }
 
 void SetBlobReadOnly(std::string file) {
@@ -153,13 +408,34 @@ void SetBlobAllAccess(std::string file) {
 	}
 }
 
+//Files coming out of a workspace belong to nobody, who could still open
+//them by name and change blobs sharing the inode
 void RestoreBlobPermission(std::string file) {
-	if (chmod(file.c_str(), 0700) < 0) {
+	int fd = open(file.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0) {
+		//A link left in the workspace is not followed out of it
+		if (errno == ELOOP) {
+			unlink(file.c_str());
+		}
+		throw std::runtime_error("Cannot restore blob permission");
+	}
+	Defer fdCloser([=]() {
+		close(fd);
+	});
+	struct stat sts;
+	if (fstat(fd, &sts) < 0 || !S_ISREG(sts.st_mode)
+			|| ((sts.st_uid != 0 || sts.st_gid != 0) && fchown(fd, 0, 0) < 0)
+			|| fchmod(fd, 0700) < 0) {
 		throw std::runtime_error("Cannot restore blob permission");
 	}
 }
 
 bool HasBlob(std::string file) {
+	std::string name;
+	if (blobName(file, name)) {
+		return BlobIndex::Use(name);
+	}
+
 	struct stat sts;
 	if (stat(file.c_str(), &sts) == -1) {
 		if (errno == ENOENT) {
@@ -171,15 +447,49 @@ bool HasBlob(std::string file) {
 }
 
 void PutBlob(std::string name, const char* buf, size_t len) {
-	int fd = open(name.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0700);
-	if (fd < 0) {
-		throw std::runtime_error("put blob open failure");
+	PutBlobStream(name, [&](char* dest, size_t destLen) {
+		size_t cur = std::min(len, destLen);
+		memcpy(dest, buf, cur);
+		buf += cur;
+		len -= cur;
+		return cur;
+	});
+}
+
+//Relative to Root
+static std::string objectName(uint64_t hash, off_t size) {
+	char name[64];
+	snprintf(name, sizeof(name), "%016llx-%lld", (unsigned long long) hash,
+			(long long) size);
+	return OBJECTS_DIR + std::string(name);
+}
+
+//Points name at the inode of target, replacing whatever name was.
+//False when there is no target.
+static bool replaceWithLink(std::string target, std::string name) {
+	std::string tmp = Root + RandString();
+	if (link(target.c_str(), tmp.c_str()) < 0) {
+		if (errno == ENOENT) {
+			return false;
+		}
+		throw std::runtime_error("Cannot link blob");
 	}
-	if (write(fd, buf, len) != (int) len) {
-		close(fd);
-		throw std::runtime_error("Cannot put blob");
+	if (rename(tmp.c_str(), name.c_str()) < 0) {
+		unlink(tmp.c_str());
+		throw std::runtime_error("Cannot link blob");
 	}
-	close(fd);
+	return true;
+}
+
+bool LinkBlobByHash(std::string name, uint64_t hash, off_t size) {
+	std::string object = objectName(hash, size);
+	if (!ContentAddressed || !replaceWithLink(Root + object, name)) {
+		return false;
+	}
+	//Linked again, no longer up for eviction
+	BlobIndex::Remove(object);
+	indexFile(name, object);
+	return true;
 }
 
 std::vector<char> GetBlob(std::string name) {
@@ -188,24 +498,134 @@ std::vector<char> GetBlob(std::string name) {
 			std::istreambuf_iterator<char>());
 }
 
+void PutBlobStream(std::string name,
+		std::function<size_t(char* buf, size_t len)> read) {
+	//Named like a temporary blob, so an aborted upload gets cleaned
+	std::string tmp = Root + RandString();
+	int fd = open(tmp.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0700);
+	if (fd < 0) {
+		throw std::runtime_error("put blob open failure");
+	}
+	bool done = false;
+	Defer tmpRemover([&]() {
+		close(fd);
+		if (!done) {
+			unlink(tmp.c_str());
+		}
+	});
+
+	Hash::XXH64 hash;
+	off_t size = 0;
+	std::vector<char> buf(STREAM_BUFFER_SIZE);
+	size_t len;
+	while ((len = read(&buf[0], buf.size())) > 0) {
+		if (ContentAddressed) {
+			hash.Update(&buf[0], len);
+		}
+		size += len;
+		size_t written = 0;
+		while (written < len) {
+			ssize_t cur = write(fd, &buf[written], len - written);
+			if (cur < 0) {
+				throw std::runtime_error("Cannot put blob");
+			}
+			written += cur;
+		}
+	}
+
+	std::string object;
+	if (ContentAddressed) {
+		//Keep the first copy of the content as the object, and name it
+		object = objectName(hash.Digest(), size);
+		if (link(tmp.c_str(), (Root + object).c_str()) < 0) {
+			if (errno != EEXIST) {
+				throw std::runtime_error("Cannot store object");
+			}
+			//Unless the cleaner just took it
+			if (replaceWithLink(Root + object, name)) {
+				BlobIndex::Remove(object);
+				indexFile(name, object);
+				return;
+			}
+			object.clear();
+		}
+	}
+	if (rename(tmp.c_str(), name.c_str()) < 0) {
+		throw std::runtime_error("Cannot put blob");
+	}
+	done = true;
+	indexFile(name, object);
+}
+
+int OpenBlob(std::string name) {
+	int fd = open(name.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		throw std::runtime_error("get blob open failure");
+	}
+	indexUse(name);
+	return fd;
+}
+
+off_t BlobSize(int fd) {
+	struct stat sts;
+	if (fstat(fd, &sts) < 0) {
+		throw std::runtime_error("Cannot get stat");
+	}
+	return sts.st_size;
+}
+
+//Whether other names share the inode of blob, which must not change then
+static bool isShared(std::string blob) {
+	struct stat sts;
+	return stat(blob.c_str(), &sts) == 0 && sts.st_nlink > 1;
+}
+
+void CopyFile(std::string oldName, std::string newName);
+
+//Renames, or copies when the workspace is a tmpfs of its own
+static bool moveFile(std::string oldName, std::string newName) {
+	if (rename(oldName.c_str(), newName.c_str()) == 0) {
+		return true;
+	}
+	if (errno != EXDEV) {
+		return false;
+	}
+	CopyFile(oldName, newName);
+	unlink(oldName.c_str());
+	return true;
+}
+
 void MoveBlob2File(std::string blob, std::string file) {
-	SetBlobAllAccess(blob);
-	if (rename(blob.c_str(), file.c_str()) < 0) {
+	if (isShared(blob)) {
+		CopyBlob2File(blob, file);
+		RemoveBlob(blob);
+		return;
+	}
+	if (!moveFile(blob, file)) {
 		throw std::runtime_error("Cannot move blob to file");
 	}
+	indexRemove(blob);
+	SetBlobAllAccess(file);
 }
 
 void MoveBlob2Blob(std::string blob1, std::string blob2) {
 	if (rename(blob1.c_str(), blob2.c_str()) < 0) {
 		throw std::runtime_error("Cannot move blob to blob");
 	}
+	std::string object = indexUse(blob1).object;
+	std::string name;
+	if (blobName(blob1, name)) {
+		BlobIndex::Remove(name);
+	}
+	indexFile(blob2, object);
 }
 
 void MoveFile2Blob(std::string file, std::string blob) {
-	if (rename(file.c_str(), blob.c_str()) < 0) {
+	if (!moveFile(file, blob)) {
 		throw std::runtime_error("Cannot move file to blob");
 	}
 	RestoreBlobPermission(blob);
+	indexFile(blob, "");
 }
 
 void MoveFile2File(std::string file1, std::string file2) {
@@ -214,26 +634,97 @@ void MoveFile2File(std::string file1, std::string file2) {
 	}
 }
 
+static void copyByReadWrite(int in, int out) {
+	std::vector<char> buf(STREAM_BUFFER_SIZE);
+	ssize_t len;
+	while ((len = read(in, &buf[0], buf.size())) > 0) {
+		ssize_t written = 0;
+		while (written < len) {
+			ssize_t cur = write(out, &buf[written], len - written);
+			if (cur < 0) {
+				throw std::runtime_error("Cannot copy file");
+			}
+			written += cur;
+		}
+	}
+	if (len < 0) {
+		throw std::runtime_error("Cannot copy file");
+	}
+}
+
+//Copies into a new file: a copy-on-write clone where the filesystem can
+//do it, an in-kernel copy otherwise
 void CopyFile(std::string oldName, std::string newName) {
-	std::string cmd = "cp " + oldName + " " + newName;
-	if (system(cmd.c_str()) != 0) {
+	int in = open(oldName.c_str(), O_RDONLY | O_CLOEXEC);
+	if (in < 0) {
 		throw std::runtime_error("Cannot copy file");
 	}
+	Defer inCloser([=]() {
+		close(in);
+	});
+
+	//The old target may be shared with other names
+	unlink(newName.c_str());
+	int out = open(newName.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+			0700);
+	if (out < 0) {
+		throw std::runtime_error("Cannot copy file");
+	}
+	bool done = false;
+	Defer outCloser([&]() {
+		close(out);
+		if (!done) {
+			unlink(newName.c_str());
+		}
+	});
+
+	if (ioctl(out, FICLONE, in) == 0) {
+		done = true;
+		return;
+	}
+
+	bool copied = false;
+	for (;;) {
+		ssize_t cur = copy_file_range(in, NULL, out, NULL, 1 << 30, 0);
+		if (cur > 0) {
+			copied = true;
+			continue;
+		}
+		if (cur == 0) {
+			break;
+		}
+		if (copied
+				|| (errno != EXDEV && errno != EINVAL && errno != ENOSYS
+						&& errno != EOPNOTSUPP)) {
+			throw std::runtime_error("Cannot copy file");
+		}
+		//Not supported between these two files
+		copyByReadWrite(in, out);
+		break;
+	}
+	done = true;
 }
 
 void CopyBlob2File(std::string blob, std::string file) {
+	indexUse(blob);
 	CopyFile(blob, file);
 	SetBlobAllAccess(file);
 }
 
+//Blobs are never changed in place, so they can share the inode
 void CopyBlob2Blob(std::string blob1, std::string blob2) {
-	CopyFile(blob1, blob2);
-	RestoreBlobPermission(blob2);
+	//Both names would lead to it
+	RestoreBlobPermission(blob1);
+	if (!replaceWithLink(blob1, blob2)) {
+		throw std::runtime_error("Cannot copy blob to blob");
+	}
+	indexFile(blob2, indexUse(blob1).object);
 }
 
 void CopyFile2Blob(std::string file, std::string blob) {
 	CopyFile(file, blob);
 	RestoreBlobPermission(blob);
+	indexFile(blob, "");
 }
 
 void CopyFile2File(std::string file1, std::string file2) {
@@ -244,6 +735,8 @@ void CopyFile2File(std::string file1, std::string file2) {
 void CheckString(std::string str) {
 	if (str.empty())
 		throw std::runtime_error("Name is empty");
+	if (str[0] == '.')
+		throw std::runtime_error("Name starts with a dot");
 	for (char c : str) {
 		if (!('0' <= c && c <= '9' || 'a' <= c && c <= 'z'
 				|| 'A' <= c && c <= 'Z' || c == '-' || c == '_' || c == '.')) {
@@ -256,69 +749,88 @@ void TryDelete(std::string file) {
 	unlink(file.c_str());
 }
 
-void CleanBlobs() {
-	off_t cacheTotSize = 0, tmpTotSize = 0;
-	std::vector<std::pair<off_t, std::string> > cache, tmp;
-
-	{
-		DIR* dir = opendir(Root.c_str());
-		if (dir == NULL) {
-			throw std::runtime_error("Cannot open Root");
-		}
-		Defer dirCloser([=]() {
-			closedir(dir);
-		});
-
-		struct dirent * file;
-		time_t now = time(NULL);
-		while ((file = readdir(dir)) != NULL) {
-			if (file->d_type == DT_REG) {
-				std::string fullName = Root + file->d_name;
-				struct stat sts;
-				if (stat(fullName.c_str(), &sts) < 0) {
-					throw std::runtime_error("Cannot get stat");
-				}
-				double passedSec = difftime(now,
-						std::max(sts.st_atime,
-								std::max(sts.st_ctime, sts.st_mtime)));
-				if (passedSec > MIN_DELETION_TIME) {
-					if (file->d_name[0] == '_') {
-						tmpTotSize += sts.st_size;
-						tmp.push_back(
-								std::make_pair(sts.st_size,
-										std::string(fullName)));
-					} else {
-						cacheTotSize += sts.st_size;
-						cache.push_back(
-								std::make_pair(sts.st_size,
-										std::string(fullName)));
-					}
-				}
-			}
-		}
+//Indexes a file of the compile cache, relative to Root
+static void indexCompiled(const std::string& name) {
+	struct stat sts;
+	if (stat((Root + name).c_str(), &sts) < 0) {
+		return;
 	}
+	BlobIndex::Blob blob;
+	blob.name = name;
+	blob.size = sts.st_size;
+	blob.lastUse = time(NULL);
+	indexPut(blob);
+}
 
-	int count = 0;
+bool ReadCompiled(std::string key, std::vector<char>& record) {
+	std::string name = COMPILE_DIR + key;
+	if (!BlobIndex::Use(name)) {
+		return false;
+	}
+	std::ifstream file((Root + name).c_str(), std::ios::binary);
+	if (!file) {
+		return false;
+	}
+	record.assign(std::istreambuf_iterator<char>(file),
+			std::istreambuf_iterator<char>());
+	return true;
+}
 
-	for (std::pair<off_t, std::string>& p : tmp) {
-		TryDelete(p.second);
-		count++;
+bool LinkCompiled(std::string key, std::string blob) {
+	std::string name = COMPILE_DIR + key + ".bin";
+	struct stat sts;
+	//One cached while nobody could write it may have been changed since
+	if (!BlobIndex::Use(name) || stat((Root + name).c_str(), &sts) < 0
+			|| sts.st_uid != 0 || !replaceWithLink(Root + name, blob)) {
+		return false;
 	}
+	indexFile(blob, "");
+	return true;
+}
 
-	if (cacheTotSize > MAX_CACHE_SIZE) {
-		std::sort(cache.begin(), cache.end());
-		for (std::pair<off_t, std::string>& p : cache) {
-			TryDelete(p.second);
-			cacheTotSize -= p.first;
-			count++;
-			if (cacheTotSize <= MAX_CACHE_SIZE) {
-				break;
-			}
+void PutCompiled(std::string key, const std::vector<char>& record,
+		std::string blob) {
+	std::string name = COMPILE_DIR + key;
+	//The binary goes first, a record is never written without it
+	if (!blob.empty()) {
+		//Outlives the session, so nobody must not be able to write it
+		RestoreBlobPermission(blob);
+		if (!replaceWithLink(blob, Root + name + ".bin")) {
+			throw std::runtime_error("Cannot cache binary");
 		}
+		indexCompiled(name + ".bin");
+	}
+	std::string tmp = Root + RandString();
+	int fd = open(tmp.c_str(), O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		throw std::runtime_error("Cannot cache compilation");
+	}
+	bool done = false;
+	Defer tmpRemover([&]() {
+		close(fd);
+		if (!done) {
+			unlink(tmp.c_str());
+		}
+	});
+	if (write(fd, record.data(), record.size()) != (ssize_t) record.size()
+			|| rename(tmp.c_str(), (Root + name).c_str()) < 0) {
+		throw std::runtime_error("Cannot cache compilation");
+	}
+	done = true;
+	indexCompiled(name);
+}
+
+//The index decides, the disk is not scanned again
+void CleanBlobs() {
+	std::vector<BlobIndex::Blob> expired = BlobIndex::Expire(
+			MIN_DELETION_TIME, MAX_CACHE_SIZE);
+	for (const BlobIndex::Blob& blob : expired) {
+		TryDelete(Root + blob.name);
+		releaseObject(blob.object);
 	}
 
-	if (count > 0) {
-		LOG("Just cleaned %d blobs", count);
+	if (!expired.empty()) {
+		LOG("Just cleaned %d blobs", (int) expired.size());
 	}
 }
 
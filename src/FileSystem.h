@@ -1,14 +1,31 @@
 #pragma once
 #include <string>
 #include <vector>
+#include <functional>
+#include <cstdint>
+#include <sys/types.h>
 namespace FileSystem {
 extern std::string Root;
+//Uploaded blobs are stored once per content under Root/.objects and their
+//names are hard links to them
+extern bool ContentAddressed;
 extern void Init();
 extern std::string RandString();
 extern void RecursiveRemove(std::string dirname);
-extern void RemoveSubDirs(std::string dirname);
+//Unmounts the directories under dirname not starting with a dot and moves
+//them into trash, on the same filesystem, to be removed later
+extern void RemoveSubDirs(std::string dirname, std::string trash);
 extern std::string NewTmpDir();
+//Removes a directory made by NewTmpDir
+extern void RemoveTmpDir(std::string tmpDir);
+//Bytes of the tmpfs mounted on each session's directory, 0 for none
+extern long long WorkspaceSize;
+//Whether the quota of a workspace has been used up
+extern bool WorkspaceFull(std::string tmpDir);
 extern void NewBlob(std::string path);
+//Takes note of what a run left in a blob
+extern void RefreshBlob(std::string path);
+extern void RemoveBlob(std::string path);
 extern void SetBlobReadOnly(std::string file);
 extern void SetBlobWriteOnly(std::string file);
 extern void SetBlobAllAccess(std::string file);
@@ -16,6 +33,16 @@ extern void RestoreBlobPermission(std::string file);
 extern bool HasBlob(std::string file);
 extern void PutBlob(std::string name,const char* buf,size_t len);
 extern std::vector<char> GetBlob(std::string name);
+//Fills a blob from read, which hands out up to len bytes per call and 0 at
+//the end. The blob shows up complete or not at all.
+extern void PutBlobStream(std::string name,
+		std::function<size_t(char* buf, size_t len)> read);
+//Links the object with the given XXH64 and size as blob name.
+//False when there is no such object.
+extern bool LinkBlobByHash(std::string name, uint64_t hash, off_t size);
+//Opens a blob for reading, the caller closes it
+extern int OpenBlob(std::string name);
+extern off_t BlobSize(int fd);
 extern void CheckString(std::string str);
 
 extern void MoveBlob2File(std::string blob,std::string file);
@@ -28,5 +55,15 @@ extern void CopyBlob2Blob(std::string,std::string);
 extern void CopyFile2Blob(std::string,std::string);
 extern void CopyFile2File(std::string,std::string);
 
+//Compilations are cached under Root/.compile, each as a record and maybe
+//a binary. They count towards the blob cache and expire with it.
+//Reads the record of key, false when it is not cached
+extern bool ReadCompiled(std::string key, std::vector<char>& record);
+//Links the cached binary of key as blob, false when it expired
+extern bool LinkCompiled(std::string key, std::string blob);
+//Caches the record of key and, unless it is empty, blob as its binary
+extern void PutCompiled(std::string key, const std::vector<char>& record,
+		std::string blob);
+
 extern void CleanBlobs();
 }
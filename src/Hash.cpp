@@ -0,0 +1,220 @@
+#include "Hash.h"
+#include <cstring>
+#include <algorithm>
+
+namespace Hash {
+static const uint64_t PRIME1 = 11400714785074694791ULL;
+static const uint64_t PRIME2 = 14029467366897019727ULL;
+static const uint64_t PRIME3 = 1609587929392839161ULL;
+static const uint64_t PRIME4 = 9650029242287828579ULL;
+static const uint64_t PRIME5 = 2870177450012600261ULL;
+
+static inline uint64_t rotl(uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char* p) {
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t read32(const unsigned char* p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t round(uint64_t acc, uint64_t input) {
+	acc += input * PRIME2;
+	acc = rotl(acc, 31);
+	return acc * PRIME1;
+}
+
+static inline uint64_t mergeRound(uint64_t acc, uint64_t val) {
+	acc ^= round(0, val);
+	return acc * PRIME1 + PRIME4;
+}
+
+XXH64::XXH64(uint64_t _seed) :
+		total(0), bufLen(0), seed(_seed) {
+	acc[0] = seed + PRIME1 + PRIME2;
+	acc[1] = seed + PRIME2;
+	acc[2] = seed;
+	acc[3] = seed - PRIME1;
+}
+
+void XXH64::Update(const void* data, size_t len) {
+	const unsigned char* p = (const unsigned char*) data;
+	const unsigned char* end = p + len;
+	total += len;
+
+	//Complete the stripe left over from the last call first
+	if (bufLen > 0) {
+		size_t fill = std::min(len, sizeof(buf) - bufLen);
+		memcpy(buf + bufLen, p, fill);
+		bufLen += fill;
+		p += fill;
+		if (bufLen < sizeof(buf)) {
+			return;
+		}
+		for (int i = 0; i < 4; i++) {
+			acc[i] = round(acc[i], read64(buf + i * 8));
+		}
+		bufLen = 0;
+	}
+
+	for (; p + 32 <= end; p += 32) {
+		acc[0] = round(acc[0], read64(p));
+		acc[1] = round(acc[1], read64(p + 8));
+		acc[2] = round(acc[2], read64(p + 16));
+		acc[3] = round(acc[3], read64(p + 24));
+	}
+
+	memcpy(buf, p, end - p);
+	bufLen = end - p;
+}
+
+uint64_t XXH64::Digest() const {
+	uint64_t h;
+	if (total >= 32) {
+		h = rotl(acc[0], 1) + rotl(acc[1], 7) + rotl(acc[2], 12)
+				+ rotl(acc[3], 18);
+		for (int i = 0; i < 4; i++) {
+			h = mergeRound(h, acc[i]);
+		}
+	} else {
+		h = seed + PRIME5;
+	}
+	h += total;
+
+	const unsigned char* p = buf;
+	const unsigned char* end = buf + bufLen;
+	for (; p + 8 <= end; p += 8) {
+		h ^= round(0, read64(p));
+		h = rotl(h, 27) * PRIME1 + PRIME4;
+	}
+	if (p + 4 <= end) {
+		h ^= read32(p) * PRIME1;
+		h = rotl(h, 23) * PRIME2 + PRIME3;
+		p += 4;
+	}
+	for (; p < end; p++) {
+		h ^= *p * PRIME5;
+		h = rotl(h, 11) * PRIME1;
+	}
+
+	h ^= h >> 33;
+	h *= PRIME2;
+	h ^= h >> 29;
+	h *= PRIME3;
+	h ^= h >> 32;
+	return h;
+}
+
+static const uint32_t SHA256_K[64] = { 0x428a2f98, 0x71374491, 0xb5c0fbcf,
+		0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5, 0xd807aa98,
+		0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7,
+		0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f,
+		0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152, 0xa831c66d, 0xb00327c8,
+		0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967, 0x27b70a85,
+		0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e,
+		0x92722c85, 0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819,
+		0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116, 0x1e376c08, 0x2748774c,
+		0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3, 0x748f82ee,
+		0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7,
+		0xc67178f2 };
+
+static inline uint32_t rotr(uint32_t x, int r) {
+	return (x >> r) | (x << (32 - r));
+}
+
+SHA256::SHA256() :
+		total(0), bufLen(0) {
+	static const uint32_t INIT[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+			0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+	memcpy(state, INIT, sizeof(state));
+}
+
+void SHA256::block(const unsigned char* p) {
+	uint32_t w[64];
+	for (int i = 0; i < 16; i++) {
+		w[i] = (uint32_t) p[i * 4] << 24 | (uint32_t) p[i * 4 + 1] << 16
+				| (uint32_t) p[i * 4 + 2] << 8 | p[i * 4 + 3];
+	}
+	for (int i = 16; i < 64; i++) {
+		uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18)
+				^ (w[i - 15] >> 3);
+		uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19)
+				^ (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+	uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+	for (int i = 0; i < 64; i++) {
+		uint32_t s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+		uint32_t t1 = h + s1 + ((e & f) ^ (~e & g)) + SHA256_K[i] + w[i];
+		uint32_t s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+		uint32_t t2 = s0 + ((a & b) ^ (a & c) ^ (b & c));
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+	state[5] += f;
+	state[6] += g;
+	state[7] += h;
+}
+
+void SHA256::Update(const void* data, size_t len) {
+	const unsigned char* p = (const unsigned char*) data;
+	const unsigned char* end = p + len;
+	total += len;
+
+	if (bufLen > 0) {
+		size_t fill = std::min(len, sizeof(buf) - bufLen);
+		memcpy(buf + bufLen, p, fill);
+		bufLen += fill;
+		p += fill;
+		if (bufLen < sizeof(buf)) {
+			return;
+		}
+		block(buf);
+		bufLen = 0;
+	}
+
+	for (; p + 64 <= end; p += 64) {
+		block(p);
+	}
+
+	memcpy(buf, p, end - p);
+	bufLen = end - p;
+}
+
+void SHA256::Digest(unsigned char out[SIZE]) const {
+	//Padded on a copy, so that it can go on after
+	SHA256 last = *this;
+	uint64_t bits = total * 8;
+	unsigned char pad[72] = { 0x80 };
+	size_t padLen = (bufLen < 56 ? 56 : 120) - bufLen;
+	for (int i = 0; i < 8; i++) {
+		pad[padLen + i] = bits >> (56 - i * 8);
+	}
+	last.Update(pad, padLen + 8);
+	for (int i = 0; i < 8; i++) {
+		out[i * 4] = last.state[i] >> 24;
+		out[i * 4 + 1] = last.state[i] >> 16;
+		out[i * 4 + 2] = last.state[i] >> 8;
+		out[i * 4 + 3] = last.state[i];
+	}
+}
+}
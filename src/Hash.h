@@ -0,0 +1,33 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+namespace Hash {
+//Streaming XXH64, giving the same digests as the reference implementation
+//so that clients can use any xxHash library
+class XXH64 {
+	uint64_t acc[4];
+	uint64_t total;
+	unsigned char buf[32];
+	size_t bufLen;
+	uint64_t seed;
+public:
+	XXH64(uint64_t seed = 0);
+	void Update(const void* data, size_t len);
+	uint64_t Digest() const;
+};
+
+//Streaming SHA-256 (FIPS 180-4), for keys a client must not be able to
+//collide on purpose
+class SHA256 {
+	uint32_t state[8];
+	uint64_t total;
+	unsigned char buf[64];
+	size_t bufLen;
+	void block(const unsigned char* p);
+public:
+	static const size_t SIZE = 32;
+	SHA256();
+	void Update(const void* data, size_t len);
+	void Digest(unsigned char out[SIZE]) const;
+};
+}
@@ -2,12 +2,13 @@
 #include <time.h>
 #include <stdio.h>
 
-static char prefixBuffer[100];
+static __thread char prefixBuffer[100];
 
 const char* LogPrefix() {
 	time_t now = time(NULL);
-	struct tm * tmNow = localtime(&now);
-	sprintf(prefixBuffer, "%d-%02d-%02d %02d:%02d:%02d", tmNow->tm_year+1900, tmNow->tm_mon,
-			tmNow->tm_mday, tmNow->tm_hour, tmNow->tm_min, tmNow->tm_sec);
+	struct tm tmNow;
+	localtime_r(&now, &tmNow);
+	sprintf(prefixBuffer, "%d-%02d-%02d %02d:%02d:%02d", tmNow.tm_year+1900, tmNow.tm_mon,
+			tmNow.tm_mday, tmNow.tm_hour, tmNow.tm_min, tmNow.tm_sec);
 	return prefixBuffer;
 }
@@ -1,99 +1,259 @@
 #include "Message.h"
 #include <stdexcept>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include "Log.h"
-#include "BinaryStream.h"
 namespace Message {
-static void recvAll(int sock, void* buf, size_t len) {
-	size_t received = 0;
-	while (received < len) {
-		int cur = recv(sock, (char*) buf + received, len - received, 0);
-		if (cur <= 0) {
-			ERR("recv returned %d, cannot fill buffer.", cur);
-			throw std::runtime_error("");
-		}
-		//DBG("recv returned %d",cur);
-		received += cur;
+Transport::Transport(int _sock):sock(_sock),buffer(RECV_BUFFER_SIZE),begin(0),end(0){
+	//Replies go out in one piece anyway, waiting for more only delays them.
+	//Fails on a Unix domain socket, which does not wait anyway.
+	int noDelay=1;
+	setsockopt(sock,IPPROTO_TCP,TCP_NODELAY,&noDelay,sizeof(noDelay));
+}
+
+Transport::~Transport(){
+	for(int fd:fds){
+		close(fd);
 	}
 }
 
-static void sendAll(int sock, const void* buf, int len) {
-	if (send(sock, buf, len, 0) != len) {
-		throw std::runtime_error("send didn't send all the data.");
+int Transport::Socket() const{
+	return sock;
+}
+
+bool Transport::Buffered() const{
+	return begin<end;
+}
+
+ssize_t Transport::receive(void* buf, size_t len){
+	union{
+		struct cmsghdr header;
+		char buf[CMSG_SPACE(sizeof(int)*MAX_FDS)];
+	}cmsg;
+	struct iovec iov;
+	iov.iov_base=buf;
+	iov.iov_len=len;
+	struct msghdr msg;
+	memset(&msg,0,sizeof(msg));
+	msg.msg_iov=&iov;
+	msg.msg_iovlen=1;
+	msg.msg_control=cmsg.buf;
+	msg.msg_controllen=sizeof(cmsg.buf);
+	//Not to be inherited by the runs
+	ssize_t received=recvmsg(sock,&msg,MSG_CMSG_CLOEXEC);
+	if(received<0){
+		return received;
 	}
+	for(struct cmsghdr* header=CMSG_FIRSTHDR(&msg);header!=NULL;header=CMSG_NXTHDR(&msg,header)){
+		if(header->cmsg_level!=SOL_SOCKET || header->cmsg_type!=SCM_RIGHTS){
+			continue;
+		}
+		size_t count=(header->cmsg_len-CMSG_LEN(0))/sizeof(int);
+		for(size_t i=0;i<count;i++){
+			int fd;
+			memcpy(&fd,CMSG_DATA(header)+i*sizeof(int),sizeof(int));
+			fds.push_back(fd);
+		}
+	}
+	if(fds.size()>MAX_FDS){
+		throw std::runtime_error("Too many file descriptors passed");
+	}
+	return received;
 }
 
-Message Next(int sock){
-	char buf[8];
-	recvAll(sock,buf,8);
-	Message result;
-	result.type=*(Type*)buf;
-	result.size=*(uint8_t*)(buf+4);
+void Transport::Read(void* buf, size_t len){
+	char* out=(char*)buf;
+	for(;;){
+		size_t cur=std::min(len,end-begin);
+		memcpy(out,&buffer[begin],cur);
+		begin+=cur;
+		out+=cur;
+		len-=cur;
+		if(len==0){
+			return;
+		}
+		//The buffer is empty here. Large bodies are received in place,
+		//anything else along with whatever follows it.
+		char* into=len>=buffer.size()?out:&buffer[0];
+		ssize_t received=receive(into,into==out?len:buffer.size());
+		if(received<=0){
+			if(received<0 && errno==EINTR){
+				continue;
+			}
+			ERR("recv returned %d, cannot fill buffer.",(int)received);
+			throw std::runtime_error("");
+		}
+		if(into==out){
+			out+=received;
+			len-=received;
+		}else{
+			begin=0;
+			end=received;
+		}
+	}
+}
 
-	//DBG("Just recved type=%d size=%u\n",result.type,result.size);
+void Transport::ReadHeader(Type& type, uint32_t& size, Tag& tag, bool& compressed){
+	uint32_t header[2];
+	Read(header,sizeof(header));
+	size=header[1];
+	tag.tagged=header[0]&TAGGED;
+	compressed=header[0]&COMPRESSED;
+	type=(Type)(header[0]&~(TAGGED|COMPRESSED));
+	if(tag.tagged){
+		Read(&tag.id,sizeof(tag.id));
+	}
+}
 
-	if(result.size>MAX_BODY_SIZE){
+void Transport::Next(Message& msg){
+	ReadHeader(msg.type,msg.size,msg.tag,msg.compressed);
+	if(msg.size>MAX_BODY_SIZE){
 		throw std::runtime_error("Received message body too large");
 	}
-
-	result.body.resize(result.size);
-	recvAll(sock,&result.body[0],result.size);
-	//DBG("Finished a msg");
-	return result;
+	//Keeps the capacity of the last body
+	msg.body.resize(msg.size);
+	Read(msg.body.data(),msg.size);
+	//It came with the first bytes of the frame, so it is here by now
+	msg.fd=-1;
+	if(msg.type==PUT_BLOB_FD){
+		if(fds.empty()){
+			throw std::runtime_error("PUT_BLOB_FD without a file descriptor");
+		}
+		msg.fd=fds.front();
+		fds.pop_front();
+	}
 }
 
-void Send(int sock,const Message& msg){
-	sendAll(sock,&msg.type,4);
-	sendAll(sock,&msg.size,4);
-	sendAll(sock,&msg.body[0],msg.size);
+//Header of a frame, returns its length
+static size_t header(uint32_t* buf, Type type, uint32_t size, Tag tag, bool compressed){
+	buf[0]=type;
+	if(compressed){
+		buf[0]|=COMPRESSED;
+	}
+	buf[1]=size;
+	if(!tag.tagged){
+		return 8;
+	}
+	buf[0]|=TAGGED;
+	buf[2]=tag.id;
+	return 12;
 }
 
-MsgExec ToMsgExec(const Message& msg){
-	BinaryStream stream(msg.body);
-	MsgExec result;
-	stream>>result.cmd>>result.argc;
-	for(int i=0;i<result.argc;i++){
-		std::string tmp;
-		stream>>tmp;
-		result.arg.push_back(tmp);
+void Transport::sendAll(struct iovec* iov, int count, int flags, int fd){
+	struct msghdr msg;
+	memset(&msg,0,sizeof(msg));
+	msg.msg_iov=iov;
+	msg.msg_iovlen=count;
+	union{
+		struct cmsghdr header;
+		char buf[CMSG_SPACE(sizeof(int))];
+	}cmsg;
+	if(fd>=0){
+		memset(&cmsg,0,sizeof(cmsg));
+		msg.msg_control=cmsg.buf;
+		msg.msg_controllen=sizeof(cmsg.buf);
+		struct cmsghdr* header=CMSG_FIRSTHDR(&msg);
+		header->cmsg_level=SOL_SOCKET;
+		header->cmsg_type=SCM_RIGHTS;
+		header->cmsg_len=CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(header),&fd,sizeof(int));
+	}
+	for(;;){
+		ssize_t sent=sendmsg(sock,&msg,flags|MSG_NOSIGNAL);
+		if(sent<0){
+			if(errno==EINTR){
+				continue;
+			}
+			throw std::runtime_error("send didn't send all the data.");
+		}
+		//Passed with the first bytes only
+		msg.msg_control=NULL;
+		msg.msg_controllen=0;
+		//Skip what went out, a short send goes on with the rest
+		while(msg.msg_iovlen>0 && (size_t)sent>=msg.msg_iov->iov_len){
+			sent-=msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if(msg.msg_iovlen==0){
+			return;
+		}
+		msg.msg_iov->iov_base=(char*)msg.msg_iov->iov_base+sent;
+		msg.msg_iov->iov_len-=sent;
 	}
-	stream>>result.memoryLimit>>result.outputLimit>>result.timeLimit;
-	result.restriction=stream.Read<Restriction>();
-	stream>>result.input;
-	return result;
 }
 
-Message FromMsgExecReply(const MsgExecReply& result){
-	BinaryStream stream;
-	stream<<result.exitStatus;
-	stream.Write(result.type);
-	stream<<result.output<<result.error<<result.memory<<result.time;
-	Message msg;
-	msg.type=EXEC_REPLY;
-	msg.size=stream.Length();
-	msg.body=stream.buffer;
-	return msg;
+void Transport::SendFd(const Message& msg, int fd, Tag tag){
+	uint32_t buf[3];
+	struct iovec iov[2];
+	iov[0].iov_base=buf;
+	iov[0].iov_len=header(buf,msg.type,msg.size,tag,msg.compressed);
+	iov[1].iov_base=(void*)msg.body.data();
+	iov[1].iov_len=msg.size;
+	sendAll(iov,2,0,fd);
 }
 
-MsgPutBlob ToMsgPutBlob(const Message& msg){
-	BinaryStream stream(msg.body);
-	MsgPutBlob result;
-	stream>>result.name>>result.len;
-	result.buf=&msg.body[stream.readingPointer];
-	return result;
+void Transport::Send(const Message& msg, Tag tag){
+	SendFd(msg,-1,tag);
 }
 
-MsgGetBlob ToMsgGetBlob(const Message& msg){
-	BinaryStream stream(msg.body);
-	MsgGetBlob result;
-	stream>>result.name;
-	return result;
+void Transport::SendChunk(const char* buf, uint32_t len, Tag tag, bool compressed){
+	uint32_t head[3];
+	struct iovec iov[2];
+	iov[0].iov_base=head;
+	iov[0].iov_len=header(head,BLOB_CHUNK,len,tag,compressed);
+	iov[1].iov_base=(void*)buf;
+	iov[1].iov_len=len;
+	sendAll(iov,2,0);
 }
 
-MsgCopyMove ToMsgCopyMove(const Message& msg){
-	BinaryStream stream(msg.body);
-	MsgCopyMove result;
-	stream>>result.oldName>>result.newName;
-	return result;
+void Transport::SendFile(Type type, int fd, uint32_t len, Tag tag){
+	uint32_t head[3];
+	struct iovec iov;
+	iov.iov_base=head;
+	iov.iov_len=header(head,type,len,tag,false);
+	//Held back to go out together with the start of the file
+	sendAll(&iov,1,len>0?MSG_MORE:0);
+	while(len>0){
+		ssize_t cur=sendfile(sock,fd,NULL,len);
+		if(cur<=0){
+			if(cur<0 && errno==EINTR){
+				continue;
+			}
+			//Also when the file shrank, the frame cannot be completed
+			throw std::runtime_error("sendfile didn't send all the data.");
+		}
+		len-=cur;
+	}
+}
+
+ChunkReader::ChunkReader(Transport& _transport):transport(_transport),left(0),ended(false){
+}
+
+size_t ChunkReader::Read(char* buf, size_t len){
+	while(!ended && left==0){
+		Type type;
+		Tag tag;
+		bool compressed;
+		transport.ReadHeader(type,left,tag,compressed);
+		if(type!=BLOB_CHUNK){
+			throw std::runtime_error("Expected a blob chunk");
+		}
+		ended=left==0;
+	}
+	if(ended){
+		return 0;
+	}
+	len=std::min(len,(size_t)left);
+	transport.Read(buf,len);
+	left-=len;
+	return len;
 }
 }
@@ -2,7 +2,10 @@
 #include <cstdint>
 #include <vector>
 #include <string>
+#include <deque>
+#include <sys/uio.h>
 #include "Execute.h"
+#include "Schema.h"
 
 namespace Message {
 static const size_t MAX_BODY_SIZE = 100 * 1024 * 1024;
@@ -11,28 +14,68 @@ enum Type {
 	EXIT, EXEC, EXEC_REPLY,PUT_BLOB,OK,GET_BLOB,GET_BLOB_REPLY,
 	MOVE_BLOB2FILE,MOVE_BLOB2BLOB,MOVE_FILE2FILE,MOVE_FILE2BLOB,
 	COPY_BLOB2FILE,COPY_BLOB2BLOB,COPY_FILE2FILE,COPY_FILE2BLOB,
-	HAS_BLOB,HAS_FILE,HAS_BLOB_REPLY,HAS_FILE_REPLY
+	HAS_BLOB,HAS_FILE,HAS_BLOB_REPLY,HAS_FILE_REPLY,
+	EXEC_BATCH,EXEC_BATCH_REPLY,
+	PUT_BLOB_STREAM,GET_BLOB_STREAM,BLOB_CHUNK,
+	HAS_BLOB_BY_HASH,HAS_BLOB_BY_HASH_REPLY,
+	COMPARE,COMPARE_REPLY,
+	PUT_BLOB_FD,GET_BLOB_FD,GET_BLOB_FD_REPLY,
+	COMPILE,COMPILE_REPLY
+};
+
+//Set in the type of a request which carries an ID, sent right after the
+//size. Every frame of its reply carries the flag and the ID as well, so a
+//client may send further requests without waiting and match the replies
+//as they come, in any order. Requests depending on each other must still
+//wait for the replies they depend on. Untagged requests are answered in
+//order as before, possibly between replies to tagged ones.
+static const uint32_t TAGGED = 0x40000000;
+
+//Set in the type of PUT_BLOB and PUT_BLOB_STREAM whose data is one zlib
+//stream, spread over the chunks for the latter, and in the type of GET_BLOB
+//and GET_BLOB_STREAM to ask for the same. The reply, and each of its
+//chunks, carries the flag only if it is compressed, so a client must look.
+static const uint32_t COMPRESSED = 0x20000000;
+
+struct Tag {
+	bool tagged = false;
+	uint32_t id = 0;
 };
 
 struct Message {
 	enum Type type;
 	uint32_t size;
 	std::vector<char> body;
+	//Of a received request, its replies are sent with it
+	Tag tag;
+	bool compressed = false;
+	//Passed along with a PUT_BLOB_FD, closed once it is dealt with
+	int fd = -1;
 };
 
-enum Restriction {
+enum Restriction : int32_t {
 	STRICT, LOOSE
 };
 
+inline bool ValidEnum(Restriction restriction) {
+	return restriction == STRICT || restriction == LOOSE;
+}
+
+//The bodies below are coded from their Fields, see Schema.h
+
 struct MsgExec {
 	std::string cmd;
-	int argc;
 	std::vector<std::string> arg;
 	long long memoryLimit;
 	long long outputLimit;
 	int timeLimit;
 	Restriction restriction;
 	std::string input;
+
+	template<typename Codec>
+	void Fields(Codec& codec) {
+		codec(cmd)(arg)(memoryLimit)(outputLimit)(timeLimit)(restriction)(input);
+	}
 };
 
 struct MsgExecReply {
@@ -41,28 +84,202 @@ struct MsgExecReply {
 	std::string output, error;
 	long long memory;
 	int time;
+
+	template<typename Codec>
+	void Fields(Codec& codec) {
+		codec(exitStatus)(type)(output)(error)(memory)(time);
+	}
+};
+
+//Runs exec.cmd once per input blob, exec.input is unused
+struct MsgExecBatch {
+	MsgExec exec;
+	std::vector<std::string> inputs;
+	bool stopOnFailure;
+	bool parallel;
+
+	template<typename Codec>
+	void Fields(Codec& codec) {
+		codec(exec)(inputs)(stopOnFailure)(parallel);
+	}
+};
+
+struct MsgExecBatchReply {
+	std::vector<MsgExecReply> replies;
+
+	template<typename Codec>
+	void Fields(Codec& codec) {
+		codec(replies);
+	}
 };
 
 struct MsgPutBlob{
 	std::string name;
-	int len;
-	const char* buf;
+	//Points into the body of the request
+	Schema::Bytes data;
+
+	template<typename Codec>
+	void Fields(Codec& codec){
+		codec(name)(data);
+	}
 };
 
+//Also the body of every other request naming a single blob or file
 struct MsgGetBlob{
 	std::string name;
+
+	template<typename Codec>
+	void Fields(Codec& codec){
+		codec(name);
+	}
 };
 
 struct MsgCopyMove{
 	std::string oldName;
 	std::string newName;
+
+	template<typename Codec>
+	void Fields(Codec& codec){
+		codec(oldName)(newName);
+	}
+};
+
+//HAS_BLOB_REPLY, HAS_FILE_REPLY and HAS_BLOB_BY_HASH_REPLY
+struct MsgHasReply{
+	bool has;
+
+	template<typename Codec>
+	void Fields(Codec& codec){
+		codec(has);
+	}
+};
+
+struct MsgHasBlobByHash{
+	std::string name;
+	//XXH64 of the content
+	Schema::Fixed<uint64_t> hash;
+	long long size;
+
+	template<typename Codec>
+	void Fields(Codec& codec){
+		codec(name)(hash)(size);
+	}
+};
+
+struct MsgCompare{
+	std::string expected, output;
+	//A Compare::Mode
+	int mode;
+	double tolerance;
+
+	template<typename Codec>
+	void Fields(Codec& codec){
+		codec(expected)(output)(mode)(tolerance);
+	}
+};
+
+struct MsgCompareReply{
+	bool same;
+	long long expectedPos, outputPos;
+
+	template<typename Codec>
+	void Fields(Codec& codec){
+		codec(same)(expectedPos)(outputPos);
+	}
+};
+
+//Copies the source blob to sourceFile in the workspace, runs exec there
+//and moves outputFile, if the compiler left one, to the binary blob.
+//The binary and messages of an earlier identical compilation are taken
+//from the cache instead, exec.input is unused.
+struct MsgCompile{
+	MsgExec exec;
+	std::string source;
+	std::string sourceFile, outputFile;
+	std::string binary;
+
+	template<typename Codec>
+	void Fields(Codec& codec){
+		codec(exec)(source)(sourceFile)(outputFile)(binary);
+	}
+};
+
+struct MsgCompileReply{
+	//Of the run which compiled it when cached, though output and error are
+	//new blobs either way
+	MsgExecReply result;
+	bool cached;
+
+	template<typename Codec>
+	void Fields(Codec& codec){
+		codec(result)(cached);
+	}
+};
+
+//Frames messages on one connection. Reads go through a buffer kept for the
+//whole connection, so a small request costs a single recv, and every frame
+//is sent with a single vectored send.
+//Reading is up to one thread, sending may happen from several as long as
+//the frames are not interleaved.
+//On a Unix domain socket, file descriptors may come along with the frames
+//of PUT_BLOB_FD and go along with those of GET_BLOB_FD_REPLY.
+class Transport{
+	static const size_t RECV_BUFFER_SIZE=64*1024;
+	//Passed but not taken yet
+	static const size_t MAX_FDS=16;
+	int sock;
+	std::vector<char> buffer;
+	//Received but not read yet
+	size_t begin,end;
+	std::deque<int> fds;
+	Transport(const Transport&);
+	Transport& operator=(const Transport&);
+	ssize_t receive(void* buf, size_t len);
+	void sendAll(struct iovec* iov, int count, int flags, int fd=-1);
+public:
+	Transport(int sock);
+	~Transport();
+	int Socket() const;
+	//Whether more has been received already
+	bool Buffered() const;
+	void Read(void* buf, size_t len);
+	void ReadHeader(Type& type, uint32_t& size, Tag& tag, bool& compressed);
+	//Reads the next message into msg, reusing its body
+	void Next(Message& msg);
+	void Send(const Message& msg, Tag tag = Tag());
+	//Sends one BLOB_CHUNK frame, an empty one ends the stream
+	void SendChunk(const char* buf, uint32_t len, Tag tag = Tag(),
+			bool compressed = false);
+	//Sends the next len bytes of fd as the body of a message with sendfile,
+	//so the data never passes through the daemon
+	void SendFile(Type type, int fd, uint32_t len, Tag tag = Tag());
+	//Sends a message with fd passed along unless it is -1. It stays open.
+	void SendFd(const Message& msg, int fd, Tag tag = Tag());
 };
 
-extern Message Next(int sock);
-extern void Send(int sock, const Message& msg);
-extern MsgExec ToMsgExec(const Message& msg);
-extern Message FromMsgExecReply(const MsgExecReply& result);
-extern MsgPutBlob ToMsgPutBlob(const Message& msg);
-extern MsgGetBlob ToMsgGetBlob(const Message& msg);
-extern MsgCopyMove ToMsgCopyMove(const Message& msg);
+//Reads the BLOB_CHUNK frames following PUT_BLOB_STREAM.
+//Chunks are read piecewise, so they may be of any size.
+class ChunkReader{
+	Transport& transport;
+	uint32_t left;
+	bool ended;
+public:
+	ChunkReader(Transport& transport);
+	//Reads up to len bytes, 0 once the empty chunk has arrived
+	size_t Read(char* buf, size_t len);
+};
+
+template<typename T>
+T Decode(const Message& msg){
+	return Schema::Decode<T>(msg.body);
+}
+
+template<typename T>
+Message Encode(Type type, const T& body){
+	Message msg;
+	msg.type=type;
+	Schema::Encode(body,msg.body);
+	msg.size=msg.body.size();
+	return msg;
+}
 }
@@ -0,0 +1,299 @@
+#include "Pch.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include "Log.h"
+#include "Defer.h"
+#include "Hash.h"
+#include "Schema.h"
+#include "FileSystem.h"
+
+namespace Pch {
+static const char* PCH_DIR = ".pch/";
+
+struct Set {
+	//Resolved by Init
+	std::string compiler;
+	std::string header;
+	std::vector<std::string> flags;
+	//Relative to Root, named after all the header depends on
+	std::string dir;
+	//Set before the set is counted as built
+	bool usable;
+};
+
+//What the name of a set's directory is made from
+struct Identity {
+	std::string compiler;
+	long long device, inode, size, modified;
+	std::string header;
+	std::vector<std::string> flags;
+
+	template<typename Codec>
+	void Fields(Codec& codec) {
+		codec(compiler)(device)(inode)(size)(modified)(header)(flags);
+	}
+};
+
+static std::vector<Set> sets;
+//Sets before this one are done building, the others are not used yet
+static std::atomic<size_t> built(0);
+
+void Add(const std::string& spec) {
+	size_t first = spec.find(':');
+	size_t second =
+			first == std::string::npos ?
+					std::string::npos : spec.find(':', first + 1);
+	if (second == std::string::npos) {
+		throw std::runtime_error("Header set must be compiler:header:flags");
+	}
+	Set set;
+	set.compiler = spec.substr(0, first);
+	set.header = spec.substr(first + 1, second - first - 1);
+	std::istringstream flags(spec.substr(second + 1));
+	std::string flag;
+	while (flags >> flag) {
+		set.flags.push_back(flag);
+	}
+	set.usable = false;
+	if (set.compiler.empty() || set.compiler[0] != '/') {
+		throw std::runtime_error("Header set compiler must be an absolute path");
+	}
+	//It is placed under the set's directory as it is included
+	if (set.header.empty() || set.header[0] == '/'
+			|| set.header.find("..") != std::string::npos) {
+		throw std::runtime_error("Header set header must be a relative path");
+	}
+	sets.push_back(set);
+}
+
+//Names the directory of set after the compiler file, which an upgrade
+//replaces, and what it is asked to build. False without the compiler.
+static bool identify(Set& set) {
+	char compiler[PATH_MAX];
+	struct stat sts;
+	if (realpath(set.compiler.c_str(), compiler) == NULL
+			|| stat(compiler, &sts) < 0) {
+		ERR("Header set compiler %s not found", set.compiler.c_str());
+		return false;
+	}
+	set.compiler = compiler;
+	Identity identity;
+	identity.compiler = set.compiler;
+	identity.device = sts.st_dev;
+	identity.inode = sts.st_ino;
+	identity.size = sts.st_size;
+	identity.modified = sts.st_mtim.tv_sec * 1000000000LL
+			+ sts.st_mtim.tv_nsec;
+	identity.header = set.header;
+	identity.flags = set.flags;
+	std::vector<char> encoded;
+	Schema::Encode(identity, encoded);
+	Hash::XXH64 hash;
+	hash.Update(encoded.data(), encoded.size());
+	char name[17];
+	snprintf(name, sizeof(name), "%016llx",
+			(unsigned long long) hash.Digest());
+	set.dir = PCH_DIR + std::string(name) + "/";
+	return true;
+}
+
+//Whether the header built by an earlier run is still good. Installing a
+//header changes its ctime even when the package keeps its mtime.
+static bool fresh(const Set& set) {
+	std::string dir = FileSystem::Root + set.dir;
+	struct stat target;
+	if (stat((dir + set.header + ".gch").c_str(), &target) < 0) {
+		return false;
+	}
+	//Make rule: the target, then the files it depends on
+	std::ifstream deps((dir + ".deps").c_str());
+	std::string dep;
+	if (!(deps >> dep)) {
+		return false;
+	}
+	while (deps >> dep) {
+		struct stat sts;
+		if (dep == "\\") {
+			continue;
+		}
+		if (stat(dep.c_str(), &sts) < 0
+				|| sts.st_ctime > target.st_mtime) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void makeDirs(const std::string& dir, const std::string& header) {
+	for (size_t slash = 0;
+			(slash = header.find('/', slash + 1)) != std::string::npos;) {
+		std::string sub = dir + header.substr(0, slash);
+		if (mkdir(sub.c_str(), 0755) < 0 && errno != EEXIST) {
+			throw std::runtime_error("Cannot create header set directory");
+		}
+	}
+}
+
+//Runs the compiler as root, it is configured by whoever starts the daemon
+static bool build(const Set& set) {
+	std::string dir = FileSystem::Root + set.dir;
+	FileSystem::RecursiveRemove(dir);
+	if (mkdir(dir.c_str(), 0755) < 0) {
+		throw std::runtime_error("Cannot create header set directory");
+	}
+	makeDirs(dir, set.header);
+	std::string source = dir + ".source", deps = dir + ".deps";
+	std::string target = dir + set.header + ".gch", tmp = target + ".tmp";
+	std::ofstream(source.c_str()) << "#include <" << set.header << ">\n";
+
+	//The language is told apart by the name, as in g++ and clang++
+	size_t base = set.compiler.rfind('/') + 1;
+	bool cxx = set.compiler.find("++", base) != std::string::npos;
+	std::vector<std::string> args;
+	args.push_back(set.compiler);
+	args.insert(args.end(), set.flags.begin(), set.flags.end());
+	const char* rest[] = { "-x", cxx ? "c++-header" : "c-header",
+			source.c_str(), "-o", tmp.c_str(), "-MD", "-MF", deps.c_str() };
+	args.insert(args.end(), rest, rest + sizeof(rest) / sizeof(rest[0]));
+	std::vector<char*> argv;
+	for (std::string& arg : args) {
+		argv.push_back(&arg[0]);
+	}
+	argv.push_back(NULL);
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		throw std::runtime_error("Cannot fork header set compiler");
+	}
+	if (pid == 0) {
+		//Messages go to the log
+		int null = open("/dev/null", O_RDONLY);
+		dup2(null, STDIN_FILENO);
+		dup2(STDERR_FILENO, STDOUT_FILENO);
+		execv(argv[0], &argv[0]);
+		_exit(127);
+	}
+	int status;
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR) {
+			throw std::runtime_error("Cannot wait for header set compiler");
+		}
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		unlink(tmp.c_str());
+		return false;
+	}
+	if (chmod(tmp.c_str(), 0644) < 0
+			|| rename(tmp.c_str(), target.c_str()) < 0) {
+		unlink(tmp.c_str());
+		throw std::runtime_error("Cannot store precompiled header");
+	}
+	return true;
+}
+
+static void* buildThread(void*) {
+	for (Set& set : sets) {
+		if (!set.dir.empty()) {
+			try {
+				set.usable = fresh(set);
+				if (set.usable) {
+					LOG("Header set %s reused", set.dir.c_str());
+				} else {
+					LOG("Building header set %s: %s %s", set.dir.c_str(),
+							set.compiler.c_str(), set.header.c_str());
+					set.usable = build(set);
+					if (!set.usable) {
+						ERR("Header set %s failed to build", set.dir.c_str());
+					}
+				}
+			} catch (std::runtime_error& e) {
+				ERR("%s", e.what());
+			}
+		}
+		built++;
+	}
+	return NULL;
+}
+
+//Directories of header sets no longer configured, or of an old compiler
+static void removeStale() {
+	std::string root = FileSystem::Root + PCH_DIR;
+	DIR* dirp = opendir(root.c_str());
+	if (dirp == NULL) {
+		throw std::runtime_error("Cannot open header set directory");
+	}
+	Defer dirCloser([=]() {
+		closedir(dirp);
+	});
+	struct dirent* file;
+	while ((file = readdir(dirp)) != NULL) {
+		if (file->d_name[0] == '.') {
+			continue;
+		}
+		std::string dir = PCH_DIR + std::string(file->d_name) + "/";
+		if (std::none_of(sets.begin(), sets.end(), [&](const Set& set) {
+			return set.dir == dir;
+		})) {
+			FileSystem::RecursiveRemove(root + file->d_name);
+		}
+	}
+}
+
+void Init() {
+	//Read by the compilers, which run as nobody
+	std::string root = FileSystem::Root + PCH_DIR;
+	if (mkdir(root.c_str(), 0755) < 0 && errno != EEXIST) {
+		throw std::runtime_error("Cannot create header set directory");
+	}
+	for (Set& set : sets) {
+		if (!identify(set)) {
+			set.dir.clear();
+		}
+	}
+	removeStale();
+	if (sets.empty()) {
+		return;
+	}
+
+	pthread_t pid;
+	pthread_create(&pid, NULL, buildThread, NULL);
+}
+
+void Inject(const std::string& cmd, std::vector<std::string>& arg) {
+	size_t ready = built;
+	char compiler[PATH_MAX];
+	if (ready == 0 || cmd.empty() || cmd[0] != '/'
+			|| realpath(cmd.c_str(), compiler) == NULL) {
+		return;
+	}
+	std::vector<std::string> dirs;
+	for (size_t i = 0; i < ready; i++) {
+		const Set& set = sets[i];
+		if (!set.usable || set.compiler != compiler) {
+			continue;
+		}
+		//Built with other flags the compiler would check and skip it
+		if (std::all_of(set.flags.begin(), set.flags.end(),
+				[&](const std::string& flag) {
+					return std::find(arg.begin(), arg.end(), flag) != arg.end();
+				})) {
+			dirs.push_back("-I" + FileSystem::Root + set.dir);
+		}
+	}
+	arg.insert(arg.begin(), dirs.begin(), dirs.end());
+}
+}
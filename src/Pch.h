@@ -0,0 +1,17 @@
+#pragma once
+#include <string>
+#include <vector>
+namespace Pch {
+//Adds a header set, given as compiler:header:flags. The header is precompiled
+//for the compiler at that absolute path with the flags, separated by spaces,
+//and is used by compilations which pass all of them.
+extern void Add(const std::string& spec);
+
+//Builds the header sets under Root/.pch in the background, keeping the ones
+//an earlier run built for the same compiler and removing the rest
+extern void Init();
+
+//Lets a run of exec.cmd with arg find the precompiled headers built for it,
+//by putting their directories first on the include path
+extern void Inject(const std::string& cmd, std::vector<std::string>& arg);
+}
@@ -0,0 +1,273 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+#include <stdexcept>
+
+//A message lists its fields once, in wire order:
+//	template<typename Codec>
+//	void Fields(Codec& codec) {
+//		codec(name)(size)(flags);
+//	}
+//and the encoder and decoder below are instantiated from that for every
+//message type. Integers and bools are LEB128 varints, zigzag encoded when
+//signed. Enums sent must be declared with int32_t underneath, whatever
+//their values, and go out as a zigzag int32_t. Every enum sent has a bool
+//ValidEnum(T) next to it, found by argument dependent lookup, and others
+//are rejected on decoding. Strings, byte ranges and vectors are prefixed
+//with their length as a varint. Doubles and Fixed integers, such as hashes which
+//would not get any shorter, are sent as they are in memory.
+namespace Schema {
+template<typename T>
+struct Fixed {
+	T value;
+};
+
+//Decoded, it points into the body it was read from
+struct Bytes {
+	const char* data;
+	size_t size;
+};
+
+static const int MAX_VARINT_LEN = 10;
+
+template<typename T>
+struct IsVarint {
+	static const bool value = std::is_integral<T>::value
+			|| std::is_enum<T>::value;
+};
+
+//The integer type an enum is sent as, the same for all of them so that
+//the wire does not depend on what the compiler would pick
+template<typename T, bool = std::is_enum<T>::value>
+struct WireType {
+	typedef T type;
+};
+
+template<typename T>
+struct WireType<T, true> {
+	static_assert(
+			std::is_same<typename std::underlying_type<T>::type, int32_t>::value,
+			"Enums sent must be declared with int32_t underneath");
+	typedef int32_t type;
+};
+
+template<typename T>
+inline uint64_t zigzag(T value, std::true_type) {
+	return ((uint64_t) (int64_t) value << 1) ^ (uint64_t) ((int64_t) value >> 63);
+}
+
+template<typename T>
+inline uint64_t zigzag(T value, std::false_type) {
+	return value;
+}
+
+template<typename T>
+inline T unzigzag(uint64_t raw, std::true_type) {
+	return (T) (int64_t) ((raw >> 1) ^ (~(raw & 1) + 1));
+}
+
+template<typename T>
+inline T unzigzag(uint64_t raw, std::false_type) {
+	return (T) raw;
+}
+
+template<typename T>
+inline bool known(T value, std::true_type) {
+	return ValidEnum(value);
+}
+
+template<typename T>
+inline bool known(T value, std::false_type) {
+	return true;
+}
+
+class Encoder {
+	std::vector<char>& out;
+
+	void varint(uint64_t value) {
+		size_t len = out.size();
+		out.resize(len + MAX_VARINT_LEN);
+		char* buf = out.data();
+		while (value >= 0x80) {
+			buf[len++] = (char) (value | 0x80);
+			value >>= 7;
+		}
+		buf[len++] = (char) value;
+		out.resize(len);
+	}
+
+	void raw(const void* data, size_t len) {
+		out.insert(out.end(), (const char*) data, (const char*) data + len);
+	}
+public:
+	Encoder(std::vector<char>& out) :
+			out(out) {
+	}
+
+	template<typename T>
+	typename std::enable_if<IsVarint<T>::value, Encoder&>::type operator()(
+			const T& value) {
+		typedef typename WireType<T>::type Wire;
+		varint(zigzag((Wire) value, std::is_signed<Wire>()));
+		return *this;
+	}
+
+	Encoder& operator()(const double& value) {
+		raw(&value, sizeof(value));
+		return *this;
+	}
+
+	template<typename T>
+	Encoder& operator()(const Fixed<T>& value) {
+		raw(&value.value, sizeof(value.value));
+		return *this;
+	}
+
+	Encoder& operator()(const std::string& value) {
+		varint(value.size());
+		raw(value.data(), value.size());
+		return *this;
+	}
+
+	Encoder& operator()(const Bytes& value) {
+		varint(value.size);
+		raw(value.data, value.size);
+		return *this;
+	}
+
+	template<typename T>
+	Encoder& operator()(const std::vector<T>& values) {
+		varint(values.size());
+		for (const T& value : values) {
+			(*this)(value);
+		}
+		return *this;
+	}
+
+	//A nested message, encoding does not change it
+	template<typename T>
+	typename std::enable_if<std::is_class<T>::value, Encoder&>::type operator()(
+			const T& value) {
+		const_cast<T&>(value).Fields(*this);
+		return *this;
+	}
+};
+
+//Checks every read against the end of the body as it goes, so a body is
+//validated and decoded in the same single pass
+class Decoder {
+	const char* pos;
+	const char* end;
+
+	uint64_t varint() {
+		const unsigned char* p = (const unsigned char*) pos;
+		//A varint is at most MAX_VARINT_LEN bytes, which then need no
+		//check each
+		size_t limit = std::min((size_t) (end - pos), (size_t) MAX_VARINT_LEN);
+		uint64_t value = 0;
+		for (size_t i = 0; i < limit; i++) {
+			//The last byte has room for the top bit only
+			if (i == MAX_VARINT_LEN - 1 && p[i] > 1) {
+				break;
+			}
+			value |= (uint64_t) (p[i] & 0x7F) << (7 * i);
+			if (!(p[i] & 0x80)) {
+				pos += i + 1;
+				return value;
+			}
+		}
+		throw std::runtime_error("Bad varint in message");
+	}
+
+	const char* take(size_t len) {
+		if (len > (size_t) (end - pos)) {
+			throw std::runtime_error("Message body too short");
+		}
+		const char* data = pos;
+		pos += len;
+		return data;
+	}
+public:
+	Decoder(const std::vector<char>& in) :
+			pos(in.data()), end(in.data() + in.size()) {
+	}
+
+	template<typename T>
+	typename std::enable_if<IsVarint<T>::value, Decoder&>::type operator()(
+			T& value) {
+		typedef typename WireType<T>::type Wire;
+		uint64_t raw = varint();
+		Wire wire = unzigzag<Wire>(raw, std::is_signed<Wire>());
+		if (zigzag(wire, std::is_signed<Wire>()) != raw) {
+			throw std::runtime_error("Integer out of range in message");
+		}
+		value = (T) wire;
+		if (!known(value, std::is_enum<T>())) {
+			throw std::runtime_error("Unknown enum value in message");
+		}
+		return *this;
+	}
+
+	Decoder& operator()(double& value) {
+		memcpy(&value, take(sizeof(value)), sizeof(value));
+		return *this;
+	}
+
+	template<typename T>
+	Decoder& operator()(Fixed<T>& value) {
+		memcpy(&value.value, take(sizeof(value.value)), sizeof(value.value));
+		return *this;
+	}
+
+	Decoder& operator()(std::string& value) {
+		size_t len = varint();
+		value.assign(take(len), len);
+		return *this;
+	}
+
+	Decoder& operator()(Bytes& value) {
+		value.size = varint();
+		value.data = take(value.size);
+		return *this;
+	}
+
+	template<typename T>
+	Decoder& operator()(std::vector<T>& values) {
+		uint64_t count = varint();
+		//Every element takes a byte at least
+		if (count > (uint64_t) (end - pos)) {
+			throw std::runtime_error("Message body too short");
+		}
+		values.resize(count);
+		for (T& value : values) {
+			(*this)(value);
+		}
+		return *this;
+	}
+
+	template<typename T>
+	typename std::enable_if<std::is_class<T>::value, Decoder&>::type operator()(
+			T& value) {
+		value.Fields(*this);
+		return *this;
+	}
+};
+
+template<typename T>
+void Encode(const T& msg, std::vector<char>& out) {
+	Encoder encoder(out);
+	encoder(msg);
+}
+
+template<typename T>
+T Decode(const std::vector<char>& in) {
+	T msg;
+	Decoder decoder(in);
+	decoder(msg);
+	return msg;
+}
+}
@@ -0,0 +1,170 @@
+#include "Watchdog.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <cerrno>
+#include <cstdint>
+#include <map>
+#include <stdexcept>
+#include "Log.h"
+
+namespace Watchdog {
+static const int MAX_EVENTS = 64;
+
+//One loop watches the timers of every running sandbox
+struct Entry {
+	int timerfd;
+	int pidfd;
+	Callback callback;
+};
+
+static int epollfd = -1;
+static int nextId = 0;
+static std::map<int, Entry> watches;
+static pthread_mutex_t watchesLock = PTHREAD_MUTEX_INITIALIZER;
+
+//epoll data: id * 2 for the timer, id * 2 + 1 for the pidfd
+static uint64_t timerKey(int id) {
+	return (uint64_t) id * 2;
+}
+
+static uint64_t pidfdKey(int id) {
+	return (uint64_t) id * 2 + 1;
+}
+
+static void arm(int timerfd, long long ms) {
+	struct itimerspec spec = { };
+	//A zero it_value would disarm it
+	if (ms <= 0) {
+		spec.it_value.tv_nsec = 1;
+	} else {
+		spec.it_value.tv_sec = ms / 1000;
+		spec.it_value.tv_nsec = ms % 1000 * 1000000;
+	}
+	timerfd_settime(timerfd, 0, &spec, NULL);
+}
+
+static void disarm(int timerfd) {
+	struct itimerspec spec = { };
+	timerfd_settime(timerfd, 0, &spec, NULL);
+}
+
+static bool hasEnded(int pidfd) {
+	struct pollfd ended = { pidfd, POLLIN, 0 };
+	return poll(&ended, 1, 0) > 0;
+}
+
+static void dispatch(uint64_t key) {
+	int id = key / 2;
+	std::map<int, Entry>::iterator it = watches.find(id);
+	if (it == watches.end()) {
+		//Unwatched meanwhile
+		return;
+	}
+	Entry& watch = it->second;
+
+	if (key == pidfdKey(id)) {
+		//The process ended, its run is not going to be limited any more
+		disarm(watch.timerfd);
+		epoll_ctl(epollfd, EPOLL_CTL_DEL, watch.pidfd, NULL);
+		return;
+	}
+
+	uint64_t expirations;
+	if (read(watch.timerfd, &expirations, sizeof(expirations)) < 0) {
+		return;
+	}
+	if (hasEnded(watch.pidfd)) {
+		return;
+	}
+	long long next = watch.callback();
+	if (next >= 0) {
+		arm(watch.timerfd, next);
+	}
+}
+
+static void* watchdogThread(void*) {
+	struct epoll_event events[MAX_EVENTS];
+	for (;;) {
+		int n = epoll_wait(epollfd, events, MAX_EVENTS, -1);
+		if (n < 0) {
+			if (errno != EINTR) {
+				ERR("epoll_wait failed in watchdog");
+			}
+			continue;
+		}
+		pthread_mutex_lock(&watchesLock);
+		for (int i = 0; i < n; i++) {
+			dispatch(events[i].data.u64);
+		}
+		pthread_mutex_unlock(&watchesLock);
+	}
+	return NULL;
+}
+
+void Init() {
+	epollfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epollfd < 0) {
+		throw std::runtime_error("Cannot create watchdog epoll");
+	}
+	pthread_t tid;
+	if (pthread_create(&tid, NULL, watchdogThread, NULL) != 0) {
+		throw std::runtime_error("Cannot start watchdog");
+	}
+	LOG("Watchdog started");
+}
+
+int Watch(int pidfd, long long ms, Callback callback) {
+	int timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (timerfd < 0) {
+		throw std::runtime_error("Cannot create timerfd");
+	}
+	//epoll takes a descriptor once, a process may have several watches
+	pidfd = fcntl(pidfd, F_DUPFD_CLOEXEC, 0);
+	if (pidfd < 0) {
+		close(timerfd);
+		throw std::runtime_error("Cannot duplicate pidfd");
+	}
+
+	pthread_mutex_lock(&watchesLock);
+	int id = nextId++;
+	Entry& watch = watches[id];
+	watch.timerfd = timerfd;
+	watch.pidfd = pidfd;
+	watch.callback = callback;
+
+	struct epoll_event timerEvent = { }, pidfdEvent = { };
+	timerEvent.events = EPOLLIN;
+	timerEvent.data.u64 = timerKey(id);
+	pidfdEvent.events = EPOLLIN;
+	pidfdEvent.data.u64 = pidfdKey(id);
+	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, timerfd, &timerEvent) < 0
+			|| epoll_ctl(epollfd, EPOLL_CTL_ADD, pidfd, &pidfdEvent) < 0) {
+		epoll_ctl(epollfd, EPOLL_CTL_DEL, timerfd, NULL);
+		watches.erase(id);
+		pthread_mutex_unlock(&watchesLock);
+		close(timerfd);
+		close(pidfd);
+		throw std::runtime_error("Cannot watch process");
+	}
+	arm(timerfd, ms);
+	pthread_mutex_unlock(&watchesLock);
+	return id;
+}
+
+void Unwatch(int id) {
+	pthread_mutex_lock(&watchesLock);
+	std::map<int, Entry>::iterator it = watches.find(id);
+	if (it != watches.end()) {
+		epoll_ctl(epollfd, EPOLL_CTL_DEL, it->second.timerfd, NULL);
+		epoll_ctl(epollfd, EPOLL_CTL_DEL, it->second.pidfd, NULL);
+		close(it->second.timerfd);
+		close(it->second.pidfd);
+		watches.erase(it);
+	}
+	pthread_mutex_unlock(&watchesLock);
+}
+}
@@ -0,0 +1,14 @@
+#pragma once
+#include <functional>
+namespace Watchdog {
+//Called on the watchdog thread when a timer expires.
+//Returns in how many ms to call again, or a negative value to stop.
+typedef std::function<long long()> Callback;
+
+extern void Init();
+//Calls callback after ms milliseconds unless the process behind pidfd
+//ends first. Returns an id for Unwatch.
+extern int Watch(int pidfd, long long ms, Callback callback);
+//Once this returns the callback is not running and will never be called
+extern void Unwatch(int id);
+}